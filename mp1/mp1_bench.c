@@ -0,0 +1,505 @@
+/*
+ * mp1_bench.c: Benchmark driver for mp1
+ *
+ * Spawns N idle worker processes, registers them with the module and
+ * measures the registration, read and sweep paths. One CSV row is printed
+ * per operation and worker count:
+ *
+ *   workers,registered,op,samples,failed,min_ns,mean_ns,p50_ns,p99_ns,max_ns,ops_per_sec,bytes_per_sec
+ *
+ * ops are register, unregister (ioctl on /dev/mp1), proc_read (a full read
+ * of /proc/mp1/status), dev_read (a full pread of /dev/mp1) and sweep (the
+ * duration of a sweep as reported in the ring header). registered is the
+ * number of workers the module accepted, which the registry can keep below
+ * workers, and failed the number of operations that returned an error.
+ *
+ * Usage: mp1_bench [-n N[,N...]] [-r reads] [-s sweeps] [-H]
+ *
+ */
+
+#include<stdio.h>
+#include<string.h>
+#include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<poll.h>
+#include<signal.h>
+#include<time.h>
+#include<sys/ioctl.h>
+#include<sys/mman.h>
+#include<sys/prctl.h>
+#include<sys/types.h>
+#include<sys/wait.h>
+
+#include "mp1_dev.h"
+
+#define MP1_STATUS_PATH "/proc/mp1/status"
+#define MP1_MAX_ENTRIES_PATH "/sys/module/mp1_kernel_mod/parameters/max_entries"
+
+/* Upper bound of the worker count */
+#define MAX_WORKERS 100000
+
+/* Defaults of the command line options */
+#define DEFAULT_WORKERS "10,100,1000,10000"
+#define DEFAULT_READS 100
+#define DEFAULT_SWEEPS 20
+
+/* Latency samples of one operation */
+struct samples {
+	unsigned long long *ns;
+	size_t nr;
+	/* Bytes moved by all samples, 0 if not meaningful */
+	unsigned long long bytes;
+	/* Wall time of all samples, for the throughput */
+	unsigned long long total_ns;
+	/* Operations that failed and have no sample */
+	size_t failed;
+};
+
+static int mp1_fd = -1;
+static struct mp1_ring_header *ring_hdr;
+
+/*
+ * Func: now_ns
+ * Desc: CLOCK_MONOTONIC in ns
+ *
+ */
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Func: cmp_ull
+ * Desc: qsort comparator of unsigned long long
+ *
+ */
+static int cmp_ull(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a;
+	unsigned long long y = *(const unsigned long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Func: samples_init
+ * Desc: Make room for up to nr samples
+ *
+ */
+static int samples_init(struct samples *s, size_t nr)
+{
+	memset(s, 0, sizeof(*s));
+	s->ns = calloc(nr ? nr : 1, sizeof(*s->ns));
+	if (s->ns == NULL) {
+		perror("calloc");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Func: print_row
+ * Desc: Print one CSV row with the statistics of the samples
+ *
+ */
+static void print_row(int workers, int registered, const char *op,
+		      struct samples *s)
+{
+	unsigned long long sum = 0, min = 0, max = 0, p50 = 0, p99 = 0;
+	double ops = 0, bps = 0;
+	size_t i;
+
+	if (s->nr) {
+		qsort(s->ns, s->nr, sizeof(*s->ns), cmp_ull);
+		for (i = 0; i < s->nr; i++) {
+			sum += s->ns[i];
+		}
+		min = s->ns[0];
+		max = s->ns[s->nr - 1];
+		p50 = s->ns[s->nr / 2];
+		p99 = s->ns[(s->nr * 99) / 100];
+	}
+	if (s->total_ns) {
+		ops = s->nr * 1e9 / s->total_ns;
+		bps = s->bytes * 1e9 / s->total_ns;
+	}
+
+	printf("%d,%d,%s,%zu,%zu,%llu,%llu,%llu,%llu,%llu,%.0f,%.0f\n",
+	       workers, registered, op, s->nr, s->failed, min,
+	       s->nr ? sum / s->nr : 0, p50, p99, max, ops, bps);
+	fflush(stdout);
+}
+
+/*
+ * Func: spawn_workers
+ * Desc: Fork n workers blocked on the read end of a pipe. They exit when
+ *       the write end, returned in *release, is closed or the parent dies
+ *
+ */
+static int spawn_workers(pid_t *pids, int n, int *release)
+{
+	int fds[2], i;
+	char c;
+
+	if (pipe(fds) < 0) {
+		perror("pipe");
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			perror("fork");
+			break;
+		}
+		if (pids[i] == 0) {
+			prctl(PR_SET_PDEATHSIG, SIGKILL);
+			close(fds[1]);
+			while (read(fds[0], &c, 1) < 0 && errno == EINTR)
+				;
+			_exit(0);
+		}
+	}
+
+	close(fds[0]);
+	*release = fds[1];
+	return i;
+}
+
+/*
+ * Func: reap_workers
+ * Desc: Let the workers exit and wait for them
+ *
+ */
+static void reap_workers(int n, int release)
+{
+	close(release);
+	while (n > 0 && wait(NULL) > 0) {
+		n--;
+	}
+}
+
+/*
+ * Func: bench_ioctl
+ * Desc: Time one register or unregister ioctl per worker. Returns the
+ *       number of ioctls that succeeded
+ *
+ */
+static int bench_ioctl(int workers, int registered, const char *op,
+		       unsigned long cmd, pid_t *pids, int n)
+{
+	int ok;
+
+	struct samples s;
+	unsigned long long t0, start;
+	__u32 pid;
+	int i;
+
+	if (samples_init(&s, n)) {
+		return -1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < n; i++) {
+		pid = pids[i];
+		t0 = now_ns();
+		if (ioctl(mp1_fd, cmd, &pid) < 0) {
+			fprintf(stderr, "%s %u: %s\n", op, pid, strerror(errno));
+			s.failed++;
+			continue;
+		}
+		s.ns[s.nr++] = now_ns() - t0;
+	}
+	s.total_ns = now_ns() - start;
+
+	/* A register row reports what it registered */
+	ok = s.nr;
+	print_row(workers, cmd == MP1_IOC_REGISTER ? ok : registered, op, &s);
+	free(s.ns);
+	return ok;
+}
+
+/*
+ * Func: read_all
+ * Desc: Read fd from offset 0 until EOF into *buf, doubling *buf when it
+ *       fills up. Returns the bytes read
+ *
+ */
+static ssize_t read_all(int fd, char **buf, size_t *len)
+{
+	ssize_t ret, total = 0;
+	char *tmp;
+
+	do {
+		if ((size_t)total == *len) {
+			tmp = realloc(*buf, *len * 2);
+			if (tmp == NULL) {
+				errno = ENOMEM;
+				return -1;
+			}
+			*buf = tmp;
+			*len *= 2;
+		}
+		ret = pread(fd, *buf + total, *len - total, total);
+		if (ret < 0) {
+			return -1;
+		}
+		total += ret;
+	} while (ret > 0);
+	return total;
+}
+
+/*
+ * Func: bench_read
+ * Desc: Time the given number of full reads of path
+ *
+ */
+static int bench_read(int workers, int registered, const char *op,
+		      const char *path, int reads)
+{
+	/* A first guess, read_all grows the buffer as needed */
+	size_t len = (size_t)(workers + 1) * 256;
+	struct samples s;
+	unsigned long long t0, start;
+	ssize_t ret;
+	char *buf;
+	int fd, i;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		perror(path);
+		return -1;
+	}
+	buf = malloc(len);
+	if (buf == NULL || samples_init(&s, reads)) {
+		free(buf);
+		close(fd);
+		return -1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < reads; i++) {
+		t0 = now_ns();
+		ret = read_all(fd, &buf, &len);
+		if (ret < 0) {
+			perror(path);
+			s.failed++;
+			break;
+		}
+		s.ns[s.nr++] = now_ns() - t0;
+		s.bytes += ret;
+	}
+	s.total_ns = now_ns() - start;
+
+	print_row(workers, registered, op, &s);
+	free(s.ns);
+	free(buf);
+	close(fd);
+	return 0;
+}
+
+/*
+ * Func: bench_sweep
+ * Desc: Wait for the given number of sweeps and collect their durations
+ *
+ */
+static int bench_sweep(int workers, int registered, int sweeps)
+{
+	struct pollfd pfd = { .fd = mp1_fd, .events = POLLIN };
+	struct samples s;
+	unsigned long long start;
+	__u64 seq;
+	int i;
+
+	if (samples_init(&s, sweeps)) {
+		return -1;
+	}
+
+	/* Count from the next completed sweep */
+	if (ioctl(mp1_fd, MP1_IOC_SEQ, &seq) < 0) {
+		perror("MP1_IOC_SEQ");
+		free(s.ns);
+		return -1;
+	}
+
+	start = now_ns();
+	for (i = 0; i < sweeps; i++) {
+		if (poll(&pfd, 1, -1) < 0) {
+			perror("poll");
+			s.failed++;
+			break;
+		}
+		s.ns[s.nr++] = ring_hdr->sweep_ns;
+		ioctl(mp1_fd, MP1_IOC_SEQ, &seq);
+	}
+	s.total_ns = now_ns() - start;
+
+	print_row(workers, registered, "sweep", &s);
+	free(s.ns);
+	return 0;
+}
+
+/*
+ * Func: run
+ * Desc: One round of all benchmarks with n workers
+ *
+ */
+static int run(int n, int reads, int sweeps)
+{
+	pid_t *pids;
+	int spawned, registered, release;
+
+	pids = calloc(n, sizeof(*pids));
+	if (pids == NULL) {
+		perror("calloc");
+		return -1;
+	}
+
+	spawned = spawn_workers(pids, n, &release);
+	if (spawned < 0) {
+		free(pids);
+		return -1;
+	}
+	if (spawned < n) {
+		fprintf(stderr, "only %d of %d workers spawned\n", spawned, n);
+	}
+
+	/* Registration can fail short of max_entries when a shard of the
+	   registry fills up, the rows report how many were registered */
+	registered = bench_ioctl(spawned, 0, "register", MP1_IOC_REGISTER,
+				 pids, spawned);
+	if (registered < 0) {
+		registered = 0;
+	}
+	bench_read(spawned, registered, "proc_read", MP1_STATUS_PATH, reads);
+	bench_read(spawned, registered, "dev_read", MP1_DEV_PATH, reads);
+	bench_sweep(spawned, registered, sweeps);
+	bench_ioctl(spawned, registered, "unregister", MP1_IOC_UNREGISTER,
+		    pids, spawned);
+
+	reap_workers(spawned, release);
+	free(pids);
+	return 0;
+}
+
+/*
+ * Func: max_entries
+ * Desc: Registry size of the loaded module, or MAX_WORKERS if unknown
+ *
+ */
+static int max_entries(void)
+{
+	FILE *f = fopen(MP1_MAX_ENTRIES_PATH, "r");
+	int n = MAX_WORKERS;
+
+	if (f == NULL) {
+		return n;
+	}
+	if (fscanf(f, "%d", &n) != 1 || n < 1 || n > MAX_WORKERS) {
+		n = MAX_WORKERS;
+	}
+	fclose(f);
+	return n;
+}
+
+/*
+ * Func: usage
+ * Desc: Print the command line options
+ *
+ */
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-n N[,N...]] [-r reads] [-s sweeps] [-H]\n"
+		"  -n  worker counts to run, 1-%d, at most the module's max_entries\n"
+		"      (default " DEFAULT_WORKERS ")\n"
+		"  -r  full reads per read benchmark (default %d)\n"
+		"  -s  sweeps to time (default %d)\n"
+		"  -H  omit the CSV header\n",
+		prog, MAX_WORKERS, DEFAULT_READS, DEFAULT_SWEEPS);
+}
+
+/*
+ * Func: main
+ * Desc: main body of the benchmark driver
+ *
+ */
+int main(int argc, char **argv)
+{
+	char *counts = NULL, *tok, *save;
+	int reads = DEFAULT_READS, sweeps = DEFAULT_SWEEPS, header = 1;
+	int opt, n, max;
+
+	while ((opt = getopt(argc, argv, "n:r:s:H")) != -1) {
+		switch (opt) {
+		case 'n':
+			free(counts);
+			counts = strdup(optarg);
+			break;
+		case 'r':
+			reads = atoi(optarg);
+			break;
+		case 's':
+			sweeps = atoi(optarg);
+			break;
+		case 'H':
+			header = 0;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	/* strtok_r needs a writable copy */
+	if (counts == NULL) {
+		counts = strdup(DEFAULT_WORKERS);
+	}
+	if (counts == NULL || reads < 1 || sweeps < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if ((mp1_fd = open(MP1_DEV_PATH, O_RDONLY)) < 0) {
+		perror("open " MP1_DEV_PATH);
+		return 1;
+	}
+
+	/* The header page of the ring carries the sweep duration */
+	ring_hdr = mmap(NULL, getpagesize(), PROT_READ, MAP_SHARED, mp1_fd, 0);
+	if (ring_hdr == MAP_FAILED) {
+		perror("mmap " MP1_DEV_PATH);
+		return 1;
+	}
+
+	/* More workers than the module has slots for would fail to register */
+	max = max_entries();
+
+	if (header) {
+		printf("workers,registered,op,samples,failed,min_ns,mean_ns,"
+		       "p50_ns,p99_ns,max_ns,ops_per_sec,bytes_per_sec\n");
+	}
+
+	for (tok = strtok_r(counts, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		n = atoi(tok);
+		if (n < 1 || n > MAX_WORKERS) {
+			fprintf(stderr, "bad worker count %s\n", tok);
+			continue;
+		}
+		if (n > max) {
+			fprintf(stderr, "%d workers exceed max_entries, running %d\n",
+				n, max);
+			n = max;
+		}
+		run(n, reads, sweeps);
+	}
+
+	free(counts);
+	munmap(ring_hdr, getpagesize());
+	close(mp1_fd);
+	return 0;
+}
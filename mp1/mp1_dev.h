@@ -0,0 +1,113 @@
+#ifndef __MP1_DEV_INCLUDE__
+#define __MP1_DEV_INCLUDE__
+
+/*
+ * mp1_dev.h : Binary interface of /dev/mp1, shared by the kernel module and
+ *             user applications
+ */
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Device node created by the module */
+#define MP1_DEV_PATH "/dev/mp1"
+
+/* One record per registered process, returned by read() as a packed array.
+   The file position is in bytes, so pread(fd, buf, len, 0) takes a fresh
+   snapshot of the first len / sizeof(struct mp1_record) processes */
+struct mp1_record {
+	/* PID of the registered process */
+	__u32 pid;
+	__u32 pad;
+	/* CPU time in ns, user time or user+system depending on acct_mode */
+	__u64 cpu_time;
+	/* CLOCK_MONOTONIC time of the sample in ns */
+	__u64 timestamp;
+};
+
+/* History ring exported by mmap() of /dev/mp1. The first page holds the
+   header, the records start at the second page (mmap offset PAGE_SIZE).
+   Only the header page may be mapped writable, on its own; a mapping
+   that covers record pages must be PROT_READ. Every sweep appends one
+   record per registered process (and the final one of exited processes)
+   and then publishes the new producer index. A reader consumes records
+   [consumer, producer) at index % capacity and stores its new consumer
+   index. The module never waits for the reader: it raises reserved
+   before it overwrites any slot, so a reader re-reads reserved after
+   copying records out and drops those with index < reserved - capacity,
+   which may have been overwritten meanwhile. Records with pid 0 carry no
+   sample and are to be skipped; the module does not write any */
+struct mp1_ring_header {
+	/* Records ever written, updated by the module */
+	__u64 producer;
+	/* Records consumed, updated by the reader */
+	__u64 consumer;
+	/* Records overwritten before the reader consumed them */
+	__u64 lost;
+	/* Number of record slots in the ring */
+	__u32 capacity;
+	/* sizeof(struct mp1_record) */
+	__u32 record_size;
+	/* Number of completed sweeps, bumped after producer */
+	__u64 seq;
+	/* Duration of the last sweep in ns, set before seq is bumped */
+	__u64 sweep_ns;
+	/* Records reserved by the sweep in progress, raised before they are
+	   written. Equals producer between sweeps */
+	__u64 reserved;
+};
+
+#define MP1_IOC_MAGIC 'm'
+
+/* Register / unregister the process whose pid is pointed to by the arg.
+   Unregistering fails with EPERM unless the caller registered the process,
+   owns it or has CAP_SYS_ADMIN */
+#define MP1_IOC_REGISTER   _IOW(MP1_IOC_MAGIC, 1, __u32)
+#define MP1_IOC_UNREGISTER _IOW(MP1_IOC_MAGIC, 2, __u32)
+
+/* Store the number of completed sweeps in the __u64 pointed to by the arg.
+   poll() on /dev/mp1 (and on /proc/mp1/status) reports POLLIN once a sweep
+   completes after the last MP1_IOC_SEQ, or the last read from offset 0.
+   Pollers of /proc/mp1/status read the same count from /proc/mp1/seq */
+#define MP1_IOC_SEQ        _IOR(MP1_IOC_MAGIC, 3, __u64)
+
+/* Notification modes of a CPU budget */
+#define MP1_NOTIFY_EVENTFD 1
+#define MP1_NOTIFY_SIGNAL  2
+
+/* Registration with a CPU budget. Once the cpu time reported for pid (see
+   struct mp1_record) reaches budget_ns, the sweep that sees it notifies
+   once: MP1_NOTIFY_EVENTFD adds 1 to the eventfd arg of the registering
+   process, MP1_NOTIFY_SIGNAL sends signal arg to the registered process
+   on behalf of the registering one. The kill(2) permission check is made
+   at registration and again with the registrant's credentials when the
+   signal is sent */
+struct mp1_budget {
+	__u32 pid;
+	__u32 mode;
+	__u64 budget_ns;
+	__s32 arg;
+	__u32 pad;
+};
+
+/* Register the process described by the struct mp1_budget pointed to by
+   the arg. budget_ns must not be 0 */
+#define MP1_IOC_REGISTER_BUDGET _IOW(MP1_IOC_MAGIC, 4, struct mp1_budget)
+
+/* Longest group name, including the terminating NUL */
+#define MP1_GROUP_NAME_LEN 32
+
+/* Registration into a named group. The group is created on first use and
+   /proc/mp1/groups reports its total cpu time: the time members used
+   while in the group, including members that exited or were
+   unregistered since. The name is NUL terminated and made of printable
+   ASCII characters other than space and ':', or the ioctl fails with
+   EINVAL */
+struct mp1_group_reg {
+	__u32 pid;
+	__u32 pad;
+	char name[MP1_GROUP_NAME_LEN];
+};
+
+#define MP1_IOC_REGISTER_GROUP _IOW(MP1_IOC_MAGIC, 5, struct mp1_group_reg)
+
+#endif
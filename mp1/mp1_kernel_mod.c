@@ -8,145 +8,3471 @@
 #include <asm/uaccess.h>
 #include <linux/kthread.h>
 #include <linux/sched.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+#include <linux/rculist.h>
+#include <linux/llist.h>
+#include <linux/slab.h>
+#include <linux/seq_file.h>
+#include <linux/profile.h>
+#include <linux/notifier.h>
+#include <linux/hrtimer.h>
+#include <linux/moduleparam.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/compat.h>
+#include <linux/device.h>
+#include <linux/vmalloc.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
+#include <linux/completion.h>
+#include <linux/cpu.h>
+#include <linux/bitmap.h>
+#include <linux/percpu.h>
+#include <linux/eventfd.h>
+#include <linux/signal.h>
+#include <linux/cred.h>
+#include <linux/capability.h>
+#include <linux/security.h>
+#include <linux/sort.h>
+#include <linux/task_io_accounting_ops.h>
 
 #include "mp1_given.h"
+#include "mp1_dev.h"
 
-/* Proc dir and proc entry to be added */
-static struct proc_dir_entry *proc_dir, *proc_entry;
+/* The registry is split into shards swept in parallel. A shard owns a
+   contiguous range of hash buckets, so a pid's bucket and list entry are
+   both covered by its shard lock */
+#define MP1_SHARD_BITS 6
+#define MP1_NR_SHARDS (1 << MP1_SHARD_BITS)
+
+/* Upper bound of the adaptive backoff, 2^16 periods */
+#define MP1_ADAPT_SHIFT_LIMIT 16
+
+/* Bounds for the sampling period in milliseconds */
+#define MP1_PERIOD_MIN_MS 1
+#define MP1_PERIOD_MAX_MS 3600000
+
+/* Utilization and its averages are percentages in fixed point */
+#define MP1_FSHIFT 20
+#define MP1_FIXED_1 (1ULL << MP1_FSHIFT)
+#define MP1_FIXED_INT(x) ((unsigned long long)((x) >> MP1_FSHIFT))
+#define MP1_FIXED_FRAC(x) \
+	((unsigned long long)((((x) & (MP1_FIXED_1 - 1)) * 100) >> MP1_FSHIFT))
+
+/* Decay factors of the exponentially weighted averages in fixed point */
+#define MP1_EXP_SHIFT 30
+#define MP1_EXP_1 (1ULL << MP1_EXP_SHIFT)
+
+/* Accounting modes. UTIME reports task->utime of the registered task as
+   before. TASK reports user+system time of the registered task in ns and
+   GROUP the same summed over its whole thread group */
+#define MP1_ACCT_UTIME 0
+#define MP1_ACCT_TASK  1
+#define MP1_ACCT_GROUP 2
+
+/* Time constants of the averages, like the 1/5/15 min load average */
+#define MP1_NR_AVG 3
+static const unsigned int mp1_avg_tau_ms[MP1_NR_AVG] = { 1000, 10000, 60000 };
+
+/* Counters sampled next to the cpu time, all cumulative: time spent
+   waiting on a run queue in ns, voluntary and involuntary context
+   switches, and the I/O accounting of /proc/<pid>/io: bytes read from and
+   written to storage, read and write syscalls, and bytes passed to them.
+   They cover the same tasks as the cpu time: in MP1_ACCT_GROUP the whole
+   thread group, otherwise only the registered task, so the I/O counters
+   are not those of /proc/<pid>/io, which sums the thread group */
+#define MP1_CNT_RUN_DELAY   0
+#define MP1_CNT_NVCSW       1
+#define MP1_CNT_NIVCSW      2
+#define MP1_CNT_READ_BYTES  3
+#define MP1_CNT_WRITE_BYTES 4
+#define MP1_CNT_SYSCR       5
+#define MP1_CNT_SYSCW       6
+#define MP1_CNT_RCHAR       7
+#define MP1_CNT_WCHAR       8
+#define MP1_NR_CNT          9
+
+/* Proc dir and proc entries to be added */
+static struct proc_dir_entry *proc_dir, *proc_entry, *proc_period, *proc_stats;
+static struct proc_dir_entry *proc_groups, *proc_top, *proc_delta;
+static struct proc_dir_entry *proc_seqno;
+
+/* Named group of registered processes, e.g. the processes of one job */
+struct mp1_group {
+	/* Link in mp1_groups */
+	struct list_head list;
+	struct rcu_head rcu;
+	char name[MP1_GROUP_NAME_LEN];
+	/* Cpu time in ns of all processes ever registered in the group,
+	   including those that exited or were unregistered since. Maintained
+	   by the sweep from the per entry deltas */
+	atomic64_t cpu_ns;
+	/* Registered members */
+	atomic_t members;
+	/* Effective uid of the creator. Only it or CAP_SYS_ADMIN may delete
+	   the group */
+	kuid_t owner;
+};
+
+/* All groups. Changed under mp1_sem, read under RCU */
+static LIST_HEAD(mp1_groups);
 
 /* Entry to be maintained for each process in a list */
 typedef struct mp1_proc_entry{
-	struct list_head list;
-	unsigned int pid;
-	unsigned long cpu_time;
+	/* Link in the PID hash bucket */
+	struct list_head hash;
+	/* Deferred free once RCU readers are done with the entry */
+	struct rcu_head rcu;
+	/* Shard the entry belongs to, and its slot in mp1_slots which holds
+	   its pid, pid reference, cpu time in ns and next sample */
+	unsigned int shard;
+	unsigned int slot;
+	/* Reported cpu time: utime in cputime units or user+system ns,
+	   depending on the accounting mode */
+	u64 cpu_time;
+	/* User and system time in ns */
+	u64 user_ns;
+	u64 sys_ns;
+	/* Accounting mode of the last sample */
+	int acct_mode;
+	/* Set by the exit hook; the entry only waits for the sweep to reap it */
+	int exited;
+	/* Group mode: an exiting thread sampled the group, the sample stands
+	   as final if the group is gone by the next sweep */
+	int exit_sampled;
+	/* Previous sample: cpu time and monotonic timestamp in ns */
+	u64 prev_cpu_ns;
+	u64 prev_stamp;
+	/* Utilization over the last interval and its averages (MP1_FSHIFT) */
+	u64 util;
+	u64 avg[MP1_NR_AVG];
+	/* Counters of the last sample, see MP1_CNT_*, their values at the
+	   previous sample and their rates per second over the last interval */
+	u64 cnt[MP1_NR_CNT];
+	u64 prev_cnt[MP1_NR_CNT];
+	u64 rate[MP1_NR_CNT];
+	/* Adaptive sampling: the entry is sampled every 2^skip_shift sweeps.
+	   idle_samples counts samples in a row that saw no change in cpu
+	   time */
+	unsigned int skip_shift;
+	unsigned int idle_samples;
+	/* Generation of the last change of the reported values, or of the
+	   registration, see mp1_gen */
+	unsigned long changed_gen;
+	/* CPU budget in ns of cpu time, 0 if none, and how to notify when it
+	   is crossed: MP1_NOTIFY_EVENTFD signals efd, MP1_NOTIFY_SIGNAL sends
+	   signo to the process. Fires once */
+	u64 budget_ns;
+	unsigned int notify;
+	int signo;
+	struct eventfd_ctx *efd;
+	int budget_fired;
+	/* MP1_NOTIFY_SIGNAL: credentials, security id and pid of the
+	   registering process. The signal is sent on its behalf and checked
+	   against the process when it fires */
+	const struct cred *sender_cred;
+	u32 sender_secid;
+	struct pid *sender;
+	/* Group of the entry or NULL, and the cpu time in ns already added to
+	   the group's total */
+	struct mp1_group *group;
+	u64 group_ns;
+	/* Effective uid of the registering process. Only it, the owner of the
+	   process or CAP_SYS_ADMIN may unregister the entry */
+	kuid_t owner;
 }MP1_PROC_ENTRY;
 
-/* List head */
-static MP1_PROC_ENTRY mp1_proc_list;
+/* Utilization of one process as ranked by /proc/mp1/top */
+struct mp1_top_item {
+	unsigned int pid;
+	u64 util;
+	u64 avg[MP1_NR_AVG];
+};
+
+/* Published top list, sorted by decreasing utilization */
+struct mp1_top {
+	struct rcu_head rcu;
+	unsigned int nr;
+	struct mp1_top_item items[];
+};
+
+/* Values of one process as of a sweep, see struct mp1_snap */
+struct mp1_snap_item {
+	unsigned int pid;
+	u64 cpu_time;
+	u64 cpu_ns;
+	u64 util;
+	u64 avg[MP1_NR_AVG];
+	u64 user_ns;
+	u64 sys_ns;
+	u64 stamp;
+	u64 cnt[MP1_NR_CNT];
+	u64 rate[MP1_NR_CNT];
+};
+
+/* Immutable copy of the registry built by a sweep. Shard i fills
+   items[i * per_shard] to items[i * per_shard + nr[i] - 1] while holding
+   its lock, so every item is consistent. The sweep builds one that no
+   reader can see, then swaps the pointer. The replaced one returns to the
+   idle list once the readers copying it are done */
+struct mp1_snap {
+	struct rcu_head rcu;
+	struct llist_node idle;
+	/* Sweep sequence number the snapshot reflects */
+	unsigned long seq;
+	unsigned int total;
+	unsigned int nr[MP1_NR_SHARDS];
+	struct mp1_snap_item *items;
+};
+
+/* A shard of the registry */
+struct mp1_shard {
+	/* Protects the shard's slots and hash buckets against updaters:
+	   registration, removal, the exit hook and the shard's sweep */
+	spinlock_t lock;
+	/* Number of registered entries, updated under lock */
+	unsigned int nr;
+	/* Min heap of the top_k busiest entries of the last sweep, merged by
+	   the kernel thread once all shards are done */
+	struct mp1_top_item *top;
+	unsigned int top_nr;
+	/* Work item refreshing the shard during a sweep */
+	struct work_struct work;
+} ____cacheline_aligned_in_smp;
+
+static struct mp1_shard mp1_shards[MP1_NR_SHARDS];
+
+/* Number of processes the registry is sized for. A pid can only take a
+   slot of its hash shard, so every shard gets its even share plus four
+   standard deviations of the spread the hash leaves between shards (see
+   mp1_registry_alloc). Registering max_entries processes then only fails
+   with -ENOSPC if one shard is hit that far beyond its share */
+static unsigned int max_entries = 16384;
+module_param(max_entries, uint, 0444);
+MODULE_PARM_DESC(max_entries, "Number of processes to size the registry for");
+
+/* Registry slots. What a sweep touches for every visited entry, sampled
+   or not, lives in parallel arrays indexed by slot, so the sweep scans
+   them linearly instead of chasing list pointers, and an entry backed off
+   by adaptive sampling costs no access to its MP1_PROC_ENTRY. A sampled
+   entry updates nearly all of its state (rates, averages, counters,
+   budget, group, snapshot), so that state stays together in the entry:
+   one object of a few cache lines rather than a line in each of a dozen
+   arrays. Shard i owns slots [i * per_shard, (i + 1) * per_shard).
+   A slot is released by the RCU callback of its entry, so lock free
+   readers may index the arrays through any entry they can see */
+static struct {
+	/* Registered pid */
+	unsigned int *pid;
+	/* Counted reference to the struct pid, held while registered */
+	struct pid **pid_ref;
+	/* Cpu time in ns of the last sample */
+	u64 *cpu_ns;
+	/* Sweep at which the entry is sampled next, see adaptive */
+	unsigned long *next_sample;
+	/* Entry owning the slot, NULL if none */
+	MP1_PROC_ENTRY __rcu **entry;
+	/* Bitmap of the free slots */
+	unsigned long *free;
+	unsigned int per_shard;
+	unsigned int nr;
+} mp1_slots;
+
+/* Cache of the MP1_PROC_ENTRY objects */
+static struct kmem_cache *mp1_entry_cache;
+
+/* PID keyed hash table of registered processes, same locking as the
+   slots. It has 2^mp1_hash_bits buckets, sized from max_entries at load
+   so a chain holds about one entry */
+static struct list_head *mp1_hash_table;
+static unsigned int mp1_hash_bits;
+
+/* Number of entries in all shards */
+static atomic_t mp1_nr_entries = ATOMIC_INIT(0);
+
+/* Parameters and completion tracking of the sweep in progress. The
+   kernel thread fills them in before queueing the shard work items */
+static struct {
+	/* One timestamp and accounting mode for the whole sweep */
+	u64 now;
+	unsigned int mode;
+	/* Sequence number of this sweep, and whether it samples adaptively */
+	unsigned long seq;
+	bool adaptive;
+	/* Shard work items still running */
+	atomic_t pending;
+	struct completion done;
+	/* Entries the shard work items visited */
+	atomic_t visited;
+	/* Snapshot being built, NULL if the sweep skips it */
+	struct mp1_snap *snap;
+} mp1_sweep;
+
+/* Workqueue running the per CPU shard sweeps */
+static struct workqueue_struct *mp1_wq;
+
+/* Adaptive sampling. An entry whose cpu time did not change for
+   adapt_idle_samples samples in a row doubles its sampling interval, up
+   to 2^adapt_max_shift periods. The first change brings it back to every
+   period */
+static bool adaptive;
+module_param(adaptive, bool, 0644);
+MODULE_PARM_DESC(adaptive, "Back off the sampling of idle processes");
+
+static unsigned int adapt_idle_samples = 4;
+module_param(adapt_idle_samples, uint, 0644);
+MODULE_PARM_DESC(adapt_idle_samples, "Unchanged samples before backing off");
+
+static unsigned int adapt_max_shift = 6;
+module_param(adapt_max_shift, uint, 0644);
+MODULE_PARM_DESC(adapt_max_shift, "Longest interval is 2^adapt_max_shift periods (max 16)");
+
+/* Length of the /proc/mp1/top list */
+static unsigned int top_k = 20;
+module_param(top_k, uint, 0444);
+MODULE_PARM_DESC(top_k, "Number of processes listed by /proc/mp1/top (max 1024)");
+
+#define MP1_TOP_K_MAX 1024
+
+/* Top list of the last sweep, replaced by every sweep */
+static struct mp1_top __rcu *mp1_top;
+
+/* Snapshot buffers: the published one, those replaced within the last
+   grace period, and idle ones a sweep may build. Allocated as the sweeps
+   need them, up to MP1_NR_SNAPS_MAX */
+#define MP1_NR_SNAPS_MAX 4
+static struct mp1_snap *mp1_snaps[MP1_NR_SNAPS_MAX];
+static unsigned int mp1_nr_snaps;
+static struct mp1_snap __rcu *mp1_snap;
+static LLIST_HEAD(mp1_snap_idle);
+
+/* Entries a shard sweep visits before dropping the shard lock and
+   letting other tasks run */
+static unsigned int sweep_batch = 64;
+module_param(sweep_batch, uint, 0644);
+MODULE_PARM_DESC(sweep_batch, "Entries swept per batch between reschedule points");
+
+/* Number of completed sweeps, and the wait queue of pollers waiting for
+   the next one */
+static unsigned long mp1_sweep_seq;
+static DECLARE_WAIT_QUEUE_HEAD (mp1_sweep_wq);
+
+/* Per open file state of /proc/mp1/status and /dev/mp1 readers */
+struct mp1_reader {
+	/* Sweep sequence number the reader has seen */
+	unsigned long seq;
+};
+
+/* Generation counter of the delta feed. Changes and registrations stamp
+   the entry with the current generation; a pass over /proc/mp1/delta
+   bumps it and reports the entries stamped since its previous pass. The
+   stamp is taken after the values are written, so a pass also reports the
+   generation its predecessor bumped from: an entry may show up twice, but
+   a change racing with a pass is never lost */
+static atomic_long_t mp1_gen = ATOMIC_LONG_INIT(0);
+
+/* Ring of the pids of removed entries, for the delta feed. mp1_tomb_head
+   counts the removals ever made */
+#define MP1_TOMB_SIZE 4096
+static unsigned int mp1_tomb[MP1_TOMB_SIZE];
+static u64 mp1_tomb_head;
+static DEFINE_SPINLOCK(mp1_tomb_lock);
+
+/* Per open file state of /proc/mp1/status: the snapshot copied out at
+   the start of a pass. A pass never blocks the sweep nor waits for it */
+struct mp1_status_reader {
+	/* Poll state, shared with the other readers */
+	struct mp1_reader base;
+	struct mp1_snap_item *items;
+	unsigned int nr;
+	unsigned int size;
+};
+
+/* Per open file state of /proc/mp1/delta */
+struct mp1_delta_reader {
+	/* Poll state, shared with the other readers */
+	struct mp1_reader base;
+	/* Entries stamped with gen or later are reported by this pass; the
+	   next pass starts from next_gen - 1 */
+	unsigned long gen;
+	unsigned long next_gen;
+	/* Removals [tomb_from, tomb_to) are reported by this pass, the next
+	   one starts at tomb_next */
+	u64 tomb_from;
+	u64 tomb_to;
+	u64 tomb_next;
+	/* Set if the reader missed removals, the next pass then resyncs */
+	int lost;
+	/* This pass is a full listing */
+	int resync;
+	/* Pid of the removal being shown */
+	unsigned int tomb_pid;
+	/* Values of the entry being shown, copied under its shard lock */
+	struct mp1_snap_item item;
+};
+
+/* History ring shared with user space through mmap of /dev/mp1. One
+   header page followed by the record pages, written by the sweep only */
+static unsigned int ring_pages = 256;
+module_param(ring_pages, uint, 0444);
+MODULE_PARM_DESC(ring_pages, "Pages of history records mmap'able from /dev/mp1");
+
+static void *mp1_ring;
+static struct mp1_ring_header *mp1_ring_hdr;
+static struct mp1_record *mp1_ring_recs;
+
+/* Number of record slots. The header holds a copy for the reader, which
+   may write to the header page, so the sweep only uses this one */
+static u32 mp1_ring_cap;
+
+/* Producer index and lost count, shared by the shard sweeps. Copied to
+   the header when a sweep is published. mp1_ring_lock orders the shards'
+   reservations, so the reserved index in the header only grows */
+static u64 mp1_ring_prod;
+static atomic64_t mp1_ring_lost = ATOMIC64_INIT(0);
+static DEFINE_SPINLOCK(mp1_ring_lock);
+
+/* Records of a sweep staged per shard, one per slot at most. Shard i
+   stages in the range of its slots and reserves ring slots for exactly
+   what it staged once its work item is done */
+static struct mp1_record *mp1_ring_stage;
+
+/* A shard sweep's staged records */
+struct mp1_ring_cursor {
+	struct mp1_record *recs;
+	unsigned int nr;
+};
+
+/* Character device /dev/mp1 */
+static dev_t mp1_dev;
+static struct cdev *mp1_cdev;
+static struct class *mp1_class;
+static struct device *mp1_device;
+
+/* Kernel Thread */
+static struct task_struct *mp1_kernel_thread;
+
+/* Wait queue for kernel thread to wait on */
+static DECLARE_WAIT_QUEUE_HEAD (mp1_waitqueue);
+
+/* Timer for waking kernel thread periodically. Armed while the registry
+   is not empty; started and cancelled under mp1_sem */
+static struct hrtimer mp1_timer;
+
+/* Semaphore serializing registration batches, period changes and the
+   starting and stopping of the timer */
+static struct semaphore mp1_sem;
+
+/* Expiry of the timer that last woke the kernel thread, in ns */
+static u64 mp1_timer_expires;
+
+/* Log2 histogram: bucket i counts values in [2^(i-1), 2^i), bucket 0 the
+   zeros */
+#define MP1_HIST_BUCKETS 64
+
+struct mp1_hist {
+	u64 count[MP1_HIST_BUCKETS];
+	u64 sum;
+};
+
+/* Instrumentation of the kernel thread, the sweep and the locks. Kept per
+   CPU so the hot paths only bump local counters; /proc/mp1/stats sums
+   them up */
+struct mp1_stats {
+	/* Completed sweeps */
+	u64 sweeps;
+	/* Slots the sweeps visited, and how many of them were sampled or
+	   skipped as backed off */
+	u64 visited;
+	u64 sampled;
+	u64 skipped;
+	/* Entries reaped because the sample found no task */
+	u64 dead;
+	/* Exit hook lookups, and those that found no entry */
+	u64 exit_lookups;
+	u64 exit_misses;
+	/* Registrations of missing pids and unregistrations of unknown ones */
+	u64 reg_misses;
+	/* CPU budgets crossed */
+	u64 budget_alarms;
+	/* Duration of a sweep, entries visited per sweep, wait for mp1_sem
+	   and lateness of the kernel thread against the timer expiry, in ns */
+	struct mp1_hist sweep_ns;
+	struct mp1_hist sweep_entries;
+	struct mp1_hist sem_wait_ns;
+	struct mp1_hist timer_late_ns;
+};
+
+static DEFINE_PER_CPU(struct mp1_stats, mp1_stats);
+
+/* Add v to a histogram of the local CPU's statistics */
+#define mp1_hist_add(hist, v)						\
+	do {								\
+		u64 __v = (v);						\
+		this_cpu_inc(mp1_stats.hist.count[min_t(unsigned int,	\
+			fls64(__v), MP1_HIST_BUCKETS - 1)]);		\
+		this_cpu_add(mp1_stats.hist.sum, __v);			\
+	} while (0)
+
+/* Func: mp1_sem_down
+ * Desc: down_interruptible on mp1_sem, accounting the time spent waiting
+ *
+ */
+static int mp1_sem_down(void)
+{
+	u64 start = ktime_to_ns(ktime_get());
+	int ret;
+
+	ret = down_interruptible(&mp1_sem);
+
+	mp1_hist_add(sem_wait_ns, ktime_to_ns(ktime_get()) - start);
+	return ret;
+}
+
+/* Sampling period in milliseconds */
+static unsigned int period_ms = 5000;
+
+/* Func: mp1_period
+ * Desc: Current sampling period as a ktime
+ *
+ */
+static inline ktime_t mp1_period(void)
+{
+	return ns_to_ktime((u64)ACCESS_ONCE(period_ms) * NSEC_PER_MSEC);
+}
+
+/* Per sampling period decay factors of the averages (MP1_EXP_SHIFT).
+   Recomputed under mp1_sem whenever the period changes */
+static u64 mp1_avg_decay[MP1_NR_AVG];
+
+/* Func: mp1_exp_neg
+ * Desc: e^(-x) for x in MP1_EXP_SHIFT fixed point. x is halved until the
+ *       Taylor series is accurate, the result is then squared back up
+ *
+ */
+static u64 mp1_exp_neg(u64 x)
+{
+	unsigned int k = 0;
+	u64 y, e;
+
+	if (x > 40 * MP1_EXP_1) {
+		return 0;
+	}
+
+	while (x > (MP1_EXP_1 >> 4)) {
+		x >>= 1;
+		k++;
+	}
+
+	/* 1 - x + x^2/2 - x^3/6 */
+	y = (x * x) >> MP1_EXP_SHIFT;
+	e = MP1_EXP_1 - x + y / 2 - ((y * x) >> MP1_EXP_SHIFT) / 6;
+
+	while (k--) {
+		e = (e * e) >> MP1_EXP_SHIFT;
+	}
+	return e;
+}
+
+/* Func: mp1_fixed_pow
+ * Desc: x^n for x in MP1_EXP_SHIFT fixed point
+ *
+ */
+static u64 mp1_fixed_pow(u64 x, unsigned long n)
+{
+	u64 result = MP1_EXP_1;
+
+	while (n) {
+		if (n & 1) {
+			result = (result * x) >> MP1_EXP_SHIFT;
+		}
+		n >>= 1;
+		x = (x * x) >> MP1_EXP_SHIFT;
+	}
+	return result;
+}
+
+/* Func: mp1_update_decay
+ * Desc: Compute the per period decay e^(-period/tau) of each average
+ *
+ */
+static void mp1_update_decay(void)
+{
+	int i;
+
+	for (i = 0; i < MP1_NR_AVG; i++) {
+		mp1_avg_decay[i] =
+			mp1_exp_neg(div_u64((u64)period_ms << MP1_EXP_SHIFT,
+					    mp1_avg_tau_ms[i]));
+	}
+}
+
+/* Func: mp1_timer_callback
+ * Desc: Timer callback to wake up the kernel thread. The timer is
+ *       forwarded from its previous expiry, so samples stay evenly spaced
+ *       however long a sweep takes
+ *
+ */
+static enum hrtimer_restart mp1_timer_callback(struct hrtimer *timer)
+{
+	/* Lets the kernel thread measure how late it runs */
+	mp1_timer_expires = ktime_to_ns(hrtimer_get_expires(timer));
+
+	/* Put the kernel thread into running state */
+	wake_up_interruptible(&mp1_waitqueue);
+
+	hrtimer_forward_now(timer, mp1_period());
+	return HRTIMER_RESTART;
+}
+
+/* Func: mp1_set_period
+ * Desc: Change the sampling period. A running timer is restarted so the
+ *       new period applies right away
+ *
+ */
+static int mp1_set_period(unsigned int ms)
+{
+	if (ms < MP1_PERIOD_MIN_MS || ms > MP1_PERIOD_MAX_MS) {
+		return -EINVAL;
+	}
+
+	if (mp1_sem_down()) {
+		return -EINTR;
+	}
+
+	period_ms = ms;
+	mp1_update_decay();
+	if (hrtimer_active(&mp1_timer)) {
+		hrtimer_start(&mp1_timer, mp1_period(), HRTIMER_MODE_REL);
+	}
+
+	up(&mp1_sem);
+
+	printk(KERN_INFO "mp1:period set to %u ms\n", ms);
+	return 0;
+}
+
+/* Func: mp1_param_set_period
+ * Desc: Setter of the period_ms module parameter
+ *
+ */
+static int mp1_param_set_period(const char *val, const struct kernel_param *kp)
+{
+	unsigned int ms;
+
+	if (kstrtouint(val, 0, &ms)) {
+		return -EINVAL;
+	}
+
+	/* At load time the module is not set up yet, just store it */
+	if (mp1_kernel_thread == NULL) {
+		if (ms < MP1_PERIOD_MIN_MS || ms > MP1_PERIOD_MAX_MS) {
+			return -EINVAL;
+		}
+		period_ms = ms;
+		return 0;
+	}
+	return mp1_set_period(ms);
+}
+
+static const struct kernel_param_ops mp1_period_param_ops = {
+	.set = mp1_param_set_period,
+	.get = param_get_uint,
+};
+
+module_param_cb(period_ms, &mp1_period_param_ops, &period_ms, 0644);
+MODULE_PARM_DESC(period_ms, "Sampling period in milliseconds (1-3600000)");
+
+/* Func: mp1_hash_bucket
+ * Desc: Hash bucket a pid falls into
+ *
+ */
+static inline struct list_head *mp1_hash_bucket(unsigned int pid)
+{
+	return &mp1_hash_table[hash_32(pid, mp1_hash_bits)];
+}
+
+/* Func: mp1_shard_index
+ * Desc: Shard owning the hash bucket of a pid
+ *
+ */
+static inline unsigned int mp1_shard_index(unsigned int pid)
+{
+	return hash_32(pid, mp1_hash_bits) >> (mp1_hash_bits - MP1_SHARD_BITS);
+}
+
+/* Func: mp1_find_entry
+ * Desc: Look up the entry of a registered pid. Caller must either be in
+ *       an RCU read side critical section or hold the lock of its shard
+ *
+ */
+static MP1_PROC_ENTRY *mp1_find_entry(unsigned int pid)
+{
+	MP1_PROC_ENTRY *tmp;
+
+	list_for_each_entry_rcu(tmp, mp1_hash_bucket(pid), hash) {
+		if (mp1_slots.pid[tmp->slot] == pid) {
+			return tmp;
+		}
+	}
+	return NULL;
+}
+
+/* Func: mp1_free_entry
+ * Desc: Free an entry and the eventfd of its budget
+ *
+ */
+static void mp1_free_entry(MP1_PROC_ENTRY *tmp)
+{
+	if (tmp->efd) {
+		eventfd_ctx_put(tmp->efd);
+	}
+	if (tmp->sender_cred) {
+		put_cred(tmp->sender_cred);
+	}
+	put_pid(tmp->sender);
+	kmem_cache_free(mp1_entry_cache, tmp);
+}
+
+/* Func: mp1_free_entry_rcu
+ * Desc: RCU callback freeing an entry and its slot after the grace period
+ *
+ */
+static void mp1_free_entry_rcu(struct rcu_head *head)
+{
+	MP1_PROC_ENTRY *tmp = container_of(head, MP1_PROC_ENTRY, rcu);
+
+	/* Drop the pid reference taken at registration */
+	put_pid(mp1_slots.pid_ref[tmp->slot]);
+	mp1_slots.pid_ref[tmp->slot] = NULL;
+	set_bit(tmp->slot, mp1_slots.free);
+	mp1_free_entry(tmp);
+}
+
+/* Func: mp1_add_entry
+ * Desc: Give a new entry a free slot of its shard and publish it in the
+ *       hash table. Returns -ENOSPC if the shard is full. Caller must hold
+ *       the shard lock
+ *
+ */
+static int mp1_add_entry(MP1_PROC_ENTRY *tmp, unsigned int pid,
+			 struct pid *pid_ref)
+{
+	struct mp1_shard *shard = &mp1_shards[tmp->shard];
+	unsigned int base = tmp->shard * mp1_slots.per_shard;
+	unsigned int end = base + mp1_slots.per_shard;
+	unsigned int slot;
+
+	/* Free bits are only cleared under the shard lock */
+	slot = find_next_bit(mp1_slots.free, end, base);
+	if (slot >= end) {
+		return -ENOSPC;
+	}
+	clear_bit(slot, mp1_slots.free);
+
+	tmp->slot = slot;
+	mp1_slots.pid[slot] = pid;
+	mp1_slots.pid_ref[slot] = pid_ref;
+	mp1_slots.cpu_ns[slot] = 0;
+	/* Sampled on every sweep until it proves idle */
+	mp1_slots.next_sample[slot] = ACCESS_ONCE(mp1_sweep_seq);
+
+	rcu_assign_pointer(mp1_slots.entry[slot], tmp);
+	list_add_rcu(&tmp->hash, mp1_hash_bucket(pid));
+	shard->nr++;
+	atomic_inc(&mp1_nr_entries);
+	return 0;
+}
+
+/* Func: mp1_remove_entry
+ * Desc: Unpublish an entry and free it and its slot once readers are done.
+ *       Caller must hold the shard lock
+ *
+ */
+static void mp1_remove_entry(MP1_PROC_ENTRY *tmp)
+{
+	/* Report the removal to the delta feed */
+	spin_lock(&mp1_tomb_lock);
+	mp1_tomb[mp1_tomb_head++ & (MP1_TOMB_SIZE - 1)] = mp1_slots.pid[tmp->slot];
+	spin_unlock(&mp1_tomb_lock);
+
+	RCU_INIT_POINTER(mp1_slots.entry[tmp->slot], NULL);
+	/* Exited entries were already unhashed by the exit hook */
+	if (!tmp->exited) {
+		list_del_rcu(&tmp->hash);
+	}
+	if (tmp->group) {
+		atomic_dec(&tmp->group->members);
+	}
+	mp1_shards[tmp->shard].nr--;
+	atomic_dec(&mp1_nr_entries);
+	call_rcu(&tmp->rcu, mp1_free_entry_rcu);
+}
+
+/* Func: mp1_next_entry
+ * Desc: Entry of the first occupied slot from *slot on, or NULL. The slot
+ *       is stored back to *slot. Caller must be in an RCU read side
+ *       critical section
+ *
+ */
+static MP1_PROC_ENTRY *mp1_next_entry(unsigned int *slot)
+{
+	MP1_PROC_ENTRY *tmp;
+
+	while ((*slot = find_next_zero_bit(mp1_slots.free, mp1_slots.nr,
+					   *slot)) < mp1_slots.nr) {
+		/* Released slots wait for the grace period with no entry */
+		tmp = rcu_dereference(mp1_slots.entry[*slot]);
+		if (tmp) {
+			return tmp;
+		}
+		(*slot)++;
+	}
+	return NULL;
+}
+
+/* Func: mp1_registry_free
+ * Desc: Free the hash table, the slot arrays and the entry cache
+ *
+ */
+static void mp1_registry_free(void)
+{
+	vfree(mp1_hash_table);
+	mp1_hash_table = NULL;
+	vfree(mp1_slots.pid);
+	vfree(mp1_slots.pid_ref);
+	vfree(mp1_slots.cpu_ns);
+	vfree(mp1_slots.next_sample);
+	vfree(mp1_slots.entry);
+	vfree(mp1_slots.free);
+	memset(&mp1_slots, 0, sizeof(mp1_slots));
+
+	if (mp1_entry_cache) {
+		kmem_cache_destroy(mp1_entry_cache);
+		mp1_entry_cache = NULL;
+	}
+}
+
+/* Func: mp1_registry_alloc
+ * Desc: Allocate the hash table and slots for max_entries processes,
+ *       spread evenly over the shards with headroom, and report the memory
+ *       each registered process costs
+ *
+ */
+static int mp1_registry_alloc(void)
+{
+	unsigned int share, i;
+	size_t nr, slot_size;
+
+	if (max_entries == 0) {
+		return -EINVAL;
+	}
+
+	/* A bucket per entry, and whole buckets per shard */
+	mp1_hash_bits = max_t(unsigned int,
+			      ilog2(roundup_pow_of_two(max_entries)),
+			      MP1_SHARD_BITS);
+	mp1_hash_table = vmalloc(sizeof(*mp1_hash_table) << mp1_hash_bits);
+	if (mp1_hash_table == NULL) {
+		return -ENOMEM;
+	}
+	for (i = 0; i < (1U << mp1_hash_bits); i++) {
+		INIT_LIST_HEAD(&mp1_hash_table[i]);
+	}
+
+	/* The number of pids hashing to a shard has a standard deviation of
+	   about sqrt(share). Shards own whole bitmap words */
+	share = DIV_ROUND_UP(max_entries, MP1_NR_SHARDS);
+	mp1_slots.per_shard = roundup(share + 4 * (int_sqrt(share) + 1),
+				      BITS_PER_LONG);
+	mp1_slots.nr = mp1_slots.per_shard * MP1_NR_SHARDS;
+	nr = mp1_slots.nr;
+
+	mp1_slots.pid = vzalloc(nr * sizeof(*mp1_slots.pid));
+	mp1_slots.pid_ref = vzalloc(nr * sizeof(*mp1_slots.pid_ref));
+	mp1_slots.cpu_ns = vzalloc(nr * sizeof(*mp1_slots.cpu_ns));
+	mp1_slots.next_sample = vzalloc(nr * sizeof(*mp1_slots.next_sample));
+	mp1_slots.entry = vzalloc(nr * sizeof(*mp1_slots.entry));
+	mp1_slots.free = vzalloc(BITS_TO_LONGS(nr) * sizeof(long));
+	mp1_entry_cache = kmem_cache_create("mp1_entry", sizeof(MP1_PROC_ENTRY),
+					    0, 0, NULL);
+
+	if (!mp1_slots.pid || !mp1_slots.pid_ref || !mp1_slots.cpu_ns ||
+	    !mp1_slots.next_sample || !mp1_slots.entry || !mp1_slots.free ||
+	    !mp1_entry_cache) {
+		mp1_registry_free();
+		return -ENOMEM;
+	}
+
+	bitmap_fill(mp1_slots.free, nr);
+
+	/* The slot arrays, plus a bit of the free bitmap, and the entry object
+	   as laid out by the slab cache */
+	slot_size = sizeof(*mp1_slots.pid) + sizeof(*mp1_slots.pid_ref) +
+		sizeof(*mp1_slots.cpu_ns) + sizeof(*mp1_slots.next_sample) +
+		sizeof(*mp1_slots.entry);
+	printk(KERN_INFO "mp1:%u slots, %u per shard, %zu bytes per process: "
+	       "%zu in slot arrays and %u in its entry\n", mp1_slots.nr,
+	       mp1_slots.per_shard,
+	       slot_size + kmem_cache_size(mp1_entry_cache), slot_size,
+	       kmem_cache_size(mp1_entry_cache));
+	return 0;
+}
+
+/* Accounting mode, see MP1_ACCT_* */
+static unsigned int acct_mode = MP1_ACCT_UTIME;
+
+/* Func: mp1_param_set_acct_mode
+ * Desc: Setter of the acct_mode module parameter
+ *
+ */
+static int mp1_param_set_acct_mode(const char *val,
+				   const struct kernel_param *kp)
+{
+	unsigned int mode;
+
+	if (kstrtouint(val, 0, &mode) || mode > MP1_ACCT_GROUP) {
+		return -EINVAL;
+	}
+	acct_mode = mode;
+	return 0;
+}
+
+static const struct kernel_param_ops mp1_acct_mode_param_ops = {
+	.set = mp1_param_set_acct_mode,
+	.get = param_get_uint,
+};
+
+module_param_cb(acct_mode, &mp1_acct_mode_param_ops, &acct_mode, 0644);
+MODULE_PARM_DESC(acct_mode, "0: utime, 1: task user+sys ns, 2: thread group user+sys ns");
+
+/* Func: mp1_split_runtime
+ * Desc: Split the precise runtime in ns into user and system parts in the
+ *       ratio of the tick based utime and stime, like cputime_adjust does
+ *
+ */
+static void mp1_split_runtime(u64 rtime, u64 utime, u64 stime,
+			      u64 *user_ns, u64 *sys_ns)
+{
+	u64 total = utime + stime;
+	u64 rem;
+
+	if (total == 0) {
+		*user_ns = rtime;
+		*sys_ns = 0;
+		return;
+	}
+
+	/* Keep (rtime % total) * utime within 64 bits */
+	while (total >= (1ULL << 31)) {
+		utime >>= 1;
+		total >>= 1;
+	}
+
+	*user_ns = div64_u64_rem(rtime, total, &rem) * utime +
+		div64_u64(rem * utime, total);
+	*sys_ns = rtime - *user_ns;
+}
+
+/* Func: mp1_run_delay
+ * Desc: Time in ns a task spent waiting on a run queue, 0 without
+ *       schedstats or delay accounting
+ *
+ */
+static inline u64 mp1_run_delay(struct task_struct *task)
+{
+#if defined(CONFIG_SCHEDSTATS) || defined(CONFIG_TASK_DELAY_ACCT)
+	return task->sched_info.run_delay;
+#else
+	return 0;
+#endif
+}
+
+/* Func: mp1_sample_io
+ * Desc: Copy I/O accounting into cnt. The counters the kernel does not
+ *       keep read as 0
+ *
+ */
+static void mp1_sample_io(struct task_io_accounting *ioac, u64 *cnt)
+{
+#ifdef CONFIG_TASK_IO_ACCOUNTING
+	cnt[MP1_CNT_READ_BYTES] = ioac->read_bytes;
+	cnt[MP1_CNT_WRITE_BYTES] = ioac->write_bytes;
+#endif
+#ifdef CONFIG_TASK_XACCT
+	cnt[MP1_CNT_SYSCR] = ioac->syscr;
+	cnt[MP1_CNT_SYSCW] = ioac->syscw;
+	cnt[MP1_CNT_RCHAR] = ioac->rchar;
+	cnt[MP1_CNT_WCHAR] = ioac->wchar;
+#endif
+}
+
+/* Func: mp1_sample_cnt
+ * Desc: Add the scheduler counters of one task to cnt
+ *
+ */
+static inline void mp1_sample_cnt(struct task_struct *task, u64 *cnt)
+{
+	cnt[MP1_CNT_RUN_DELAY] += mp1_run_delay(task);
+	cnt[MP1_CNT_NVCSW] += task->nvcsw;
+	cnt[MP1_CNT_NIVCSW] += task->nivcsw;
+}
+
+/* Func: mp1_sample
+ * Desc: Read the cpu time and counters of an entry according to the
+ *       accounting mode. Returns 0 on success, -1 if the process is gone,
+ *       1 in group mode if all threads exited, the sample being final
+ *
+ */
+static int mp1_sample(MP1_PROC_ENTRY *tmp, unsigned int mode)
+{
+	struct task_struct *task, *t;
+	struct signal_struct *sig;
+	u64 utime = 0, stime = 0, rtime = 0;
+	u64 cnt[MP1_NR_CNT] = { 0 };
+	struct task_io_accounting ioac;
+	unsigned int seq, nextseq = 0;
+	unsigned long flags;
+	int group_dead = 0;
+
+	rcu_read_lock();
+	task = pid_task(mp1_slots.pid_ref[tmp->slot], PIDTYPE_PID);
+	if (task == NULL) {
+		rcu_read_unlock();
+		return -1;
+	}
+
+	if (mode == MP1_ACCT_GROUP) {
+		/* Live threads, plus what exited threads left in the signal
+		   struct. A thread exiting moves its times to the signal struct
+		   under stats_lock, so a lockless pass that raced with it is
+		   retried with the lock held and every thread counts exactly
+		   once. __exit_signal takes stats_lock inside tasklist_lock,
+		   which IRQs take for reading, so the lock is taken with IRQs
+		   off */
+		sig = task->signal;
+		do {
+			seq = nextseq;
+			flags = read_seqbegin_or_lock_irqsave(&sig->stats_lock,
+							      &seq);
+
+			/* The run delay of exited threads is not kept */
+			utime = sig->utime;
+			stime = sig->stime;
+			rtime = sig->sum_sched_runtime;
+			memset(cnt, 0, sizeof(cnt));
+			cnt[MP1_CNT_NVCSW] = sig->nvcsw;
+			cnt[MP1_CNT_NIVCSW] = sig->nivcsw;
+			ioac = sig->ioac;
+
+			t = task;
+			do {
+				utime += t->utime;
+				stime += t->stime;
+				rtime += t->se.sum_exec_runtime;
+				mp1_sample_cnt(t, cnt);
+				task_io_accounting_add(&ioac, &t->ioac);
+			} while_each_thread(task, t);
+
+			/* If lockless access failed, take the lock */
+			nextseq = 1;
+		} while (need_seqretry(&sig->stats_lock, seq));
+		done_seqretry_irqrestore(&sig->stats_lock, seq, flags);
+
+		group_dead = atomic_read(&sig->live) == 0;
+	} else {
+		utime = task->utime;
+		stime = task->stime;
+		rtime = task->se.sum_exec_runtime;
+		mp1_sample_cnt(task, cnt);
+		ioac = task->ioac;
+	}
+	rcu_read_unlock();
+
+	mp1_sample_io(&ioac, cnt);
+
+	memcpy(tmp->cnt, cnt, sizeof(tmp->cnt));
+
+	if (mode == MP1_ACCT_UTIME) {
+		tmp->cpu_time = utime;
+		tmp->user_ns = (u64)cputime_to_usecs(utime) * NSEC_PER_USEC;
+		tmp->sys_ns = (u64)cputime_to_usecs(stime) * NSEC_PER_USEC;
+		mp1_slots.cpu_ns[tmp->slot] = tmp->user_ns;
+	} else {
+		mp1_split_runtime(rtime, utime, stime,
+				  &tmp->user_ns, &tmp->sys_ns);
+		tmp->cpu_time = mp1_slots.cpu_ns[tmp->slot] = rtime;
+	}
+
+	/* Samples taken in another mode are not comparable */
+	if (tmp->acct_mode != mode) {
+		tmp->acct_mode = mode;
+		tmp->prev_stamp = 0;
+	}
+	return group_dead;
+}
+
+/* Func: mp1_task_exit_notify
+ * Desc: Task exit hook. Records the final cpu time of a registered process
+ *       and deregisters it. The entry stays on the list with its final
+ *       value until the next sweep reaps it. Runs for every exiting task,
+ *       so unregistered tasks only cost one RCU hash lookup. In thread
+ *       group mode every exiting thread refreshes the group's sample, so
+ *       the last one to pass leaves the final value even when the last
+ *       threads exit together and none sees itself as the last. Only a
+ *       thread that is alone for sure finalizes the entry; otherwise the
+ *       next sweep does once it finds the group dead or gone
+ *
+ */
+static int mp1_task_exit_notify(struct notifier_block *nb,
+				unsigned long val, void *data)
+{
+	struct task_struct *task = data;
+	unsigned int mode = ACCESS_ONCE(acct_mode);
+	unsigned int pid;
+	struct pid *pid_ref;
+	struct mp1_shard *shard;
+	MP1_PROC_ENTRY *tmp;
+	int last = 1;
+
+	if (mode == MP1_ACCT_GROUP) {
+		/* live drops only after this hook, racing threads all see
+		   more than one */
+		last = atomic_read(&task->signal->live) <= 1;
+		pid = task_tgid_nr(task);
+		pid_ref = task_tgid(task);
+	} else {
+		pid = task_pid_nr(task);
+		pid_ref = task_pid(task);
+	}
+
+	rcu_read_lock();
+	tmp = mp1_find_entry(pid);
+	rcu_read_unlock();
+
+	this_cpu_inc(mp1_stats.exit_lookups);
+	if (tmp == NULL) {
+		this_cpu_inc(mp1_stats.exit_misses);
+		return NOTIFY_DONE;
+	}
+
+	shard = &mp1_shards[mp1_shard_index(pid)];
+	spin_lock(&shard->lock);
+
+	/* Look the entry up again now that it cannot go away */
+	tmp = mp1_find_entry(pid);
+	if (tmp && mp1_slots.pid_ref[tmp->slot] == pid_ref) {
+		mp1_sample(tmp, mode);
+		tmp->changed_gen = atomic_long_read(&mp1_gen);
+		/* A backed off entry must not hide from the sweep reaping it */
+		mp1_slots.next_sample[tmp->slot] = ACCESS_ONCE(mp1_sweep_seq);
+		if (last) {
+			tmp->prev_stamp = ktime_to_ns(ktime_get());
+			tmp->exited = 1;
+			list_del_rcu(&tmp->hash);
+			printk(KERN_INFO "mp1:%u exited, cpu time %llu\n",
+			       pid, tmp->cpu_time);
+		} else {
+			tmp->exit_sampled = 1;
+		}
+	}
+
+	spin_unlock(&shard->lock);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block mp1_exit_nb = {
+	.notifier_call = mp1_task_exit_notify,
+};
+
+/* Func: mp1_snap_fill
+ * Desc: Copy the values of an entry into a snapshot item. Caller must
+ *       hold the lock of the entry's shard for a consistent copy
+ *
+ */
+static void mp1_snap_fill(struct mp1_snap_item *item, MP1_PROC_ENTRY *tmp)
+{
+	item->pid = mp1_slots.pid[tmp->slot];
+	item->cpu_time = tmp->cpu_time;
+	item->cpu_ns = mp1_slots.cpu_ns[tmp->slot];
+	item->util = tmp->util;
+	memcpy(item->avg, tmp->avg, sizeof(item->avg));
+	item->user_ns = tmp->user_ns;
+	item->sys_ns = tmp->sys_ns;
+	item->stamp = tmp->prev_stamp;
+	memcpy(item->cnt, tmp->cnt, sizeof(item->cnt));
+	memcpy(item->rate, tmp->rate, sizeof(item->rate));
+}
+
+/* Func: mp1_snap_copy
+ * Desc: Copy the latest snapshot out to the reader's buffer, growing it if
+ *       needed. Neither waits for the sweep nor holds it up
+ *
+ */
+static int mp1_snap_copy(struct mp1_status_reader *reader)
+{
+	struct mp1_snap *snap;
+	unsigned int i, n, size;
+
+	for (;;) {
+		rcu_read_lock();
+		snap = rcu_dereference(mp1_snap);
+		n = snap ? snap->total : 0;
+		if (n <= reader->size) {
+			break;
+		}
+		rcu_read_unlock();
+
+		/* Some slack for the registry to grow */
+		size = n + n / 4;
+		vfree(reader->items);
+		reader->items = vmalloc(size * sizeof(*reader->items));
+		reader->size = reader->items ? size : 0;
+		if (reader->items == NULL) {
+			return -ENOMEM;
+		}
+	}
+
+	reader->nr = 0;
+	for (i = 0; snap && i < MP1_NR_SHARDS; i++) {
+		memcpy(&reader->items[reader->nr],
+		       &snap->items[i * mp1_slots.per_shard],
+		       snap->nr[i] * sizeof(*reader->items));
+		reader->nr += snap->nr[i];
+	}
+	rcu_read_unlock();
+	return 0;
+}
+
+/* Func: mp1_seq_start
+ * Desc: Start (or resume) a pass over the reader's copy of the snapshot at
+ *       item *pos. A pass from the start copies the latest snapshot out.
+ *       *pos indexes the copy, so resuming a chunk costs O(1) and a full
+ *       read O(N)
+ *
+ */
+static void *mp1_seq_start(struct seq_file *m, loff_t *pos)
+{
+	struct mp1_status_reader *reader = m->private;
+	int ret;
+
+	/* A pass from the start sees the data of the latest sweep */
+	if (*pos == 0) {
+		reader->base.seq = ACCESS_ONCE(mp1_sweep_seq);
+		if ((ret = mp1_snap_copy(reader)) != 0) {
+			return ERR_PTR(ret);
+		}
+	}
+
+	return *pos < reader->nr ? &reader->items[*pos] : NULL;
+}
+
+/* Func: mp1_seq_next
+ * Desc: Advance to the next item of the copy
+ *
+ */
+static void *mp1_seq_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct mp1_status_reader *reader = m->private;
+
+	(*pos)++;
+	return *pos < reader->nr ? &reader->items[*pos] : NULL;
+}
+
+/* Func: mp1_seq_stop
+ * Desc: End of a chunk, nothing is held
+ *
+ */
+static void mp1_seq_stop(struct seq_file *m, void *v)
+{
+}
+
+/* Func: mp1_show_item
+ * Desc: Provide pid and cpu time of one registered process to the user,
+ *       followed by the utilization of the last interval and its 1s, 10s
+ *       and 60s averages in percent, user and system time in ns, the run
+ *       queue wait in ns and in percent of the last interval, the
+ *       voluntary and involuntary context switches per second, and per
+ *       second over the last interval: storage bytes read and written,
+ *       read and write syscalls, and bytes read and written by syscalls.
+ *       The counters are per task unless acct_mode is MP1_ACCT_GROUP
+ *
+ */
+static void mp1_show_item(struct seq_file *m, struct mp1_snap_item *item)
+{
+	/* ns of wait per second, 10^7 of them are one percent */
+	u64 delay = item->rate[MP1_CNT_RUN_DELAY];
+
+	seq_printf(m, "%u:%llu %llu.%02llu %llu.%02llu %llu.%02llu %llu.%02llu"
+		   " %llu %llu %llu %llu.%02llu %llu %llu %llu %llu %llu %llu"
+		   " %llu %llu\n",
+		   item->pid, item->cpu_time,
+		   MP1_FIXED_INT(item->util), MP1_FIXED_FRAC(item->util),
+		   MP1_FIXED_INT(item->avg[0]), MP1_FIXED_FRAC(item->avg[0]),
+		   MP1_FIXED_INT(item->avg[1]), MP1_FIXED_FRAC(item->avg[1]),
+		   MP1_FIXED_INT(item->avg[2]), MP1_FIXED_FRAC(item->avg[2]),
+		   item->user_ns, item->sys_ns, item->cnt[MP1_CNT_RUN_DELAY],
+		   div64_u64(delay, 10000000), div64_u64(delay, 100000) % 100,
+		   item->rate[MP1_CNT_NVCSW], item->rate[MP1_CNT_NIVCSW],
+		   item->rate[MP1_CNT_READ_BYTES],
+		   item->rate[MP1_CNT_WRITE_BYTES],
+		   item->rate[MP1_CNT_SYSCR], item->rate[MP1_CNT_SYSCW],
+		   item->rate[MP1_CNT_RCHAR], item->rate[MP1_CNT_WCHAR]);
+}
+
+/* Func: mp1_seq_show
+ * Desc: Show one entry of /proc/mp1/status
+ *
+ */
+static int mp1_seq_show(struct seq_file *m, void *v)
+{
+	mp1_show_item(m, v);
+	return 0;
+}
+
+static const struct seq_operations mp1_seq_ops = {
+	.start = mp1_seq_start,
+	.next = mp1_seq_next,
+	.stop = mp1_seq_stop,
+	.show = mp1_seq_show,
+};
+
+/* Func: mp1_proc_open
+ * Desc: Open /proc/mp1/status as a seq_file
+ *
+ */
+static int mp1_proc_open(struct inode *inode, struct file *file)
+{
+	struct mp1_status_reader *reader;
+
+	reader = __seq_open_private(file, &mp1_seq_ops, sizeof(*reader));
+	if (reader == NULL) {
+		return -ENOMEM;
+	}
+	reader->base.seq = ACCESS_ONCE(mp1_sweep_seq);
+	return 0;
+}
+
+/* Func: mp1_proc_release
+ * Desc: Release /proc/mp1/status and the reader's copy of the snapshot
+ *
+ */
+static int mp1_proc_release(struct inode *inode, struct file *file)
+{
+	struct seq_file *m = file->private_data;
+	struct mp1_status_reader *reader = m->private;
+
+	vfree(reader->items);
+	return seq_release_private(inode, file);
+}
+
+/* Func: mp1_reader_poll
+ * Desc: Readable once a sweep completed after the reader's last look
+ *
+ */
+static unsigned int mp1_reader_poll(struct file *file,
+				    struct mp1_reader *reader,
+				    poll_table *wait)
+{
+	poll_wait(file, &mp1_sweep_wq, wait);
+
+	if (ACCESS_ONCE(mp1_sweep_seq) != reader->seq) {
+		return POLLIN | POLLRDNORM;
+	}
+	return 0;
+}
+
+/* Func: mp1_proc_poll
+ * Desc: poll/epoll support of /proc/mp1/status
+ *
+ */
+static unsigned int mp1_proc_poll(struct file *file, poll_table *wait)
+{
+	struct seq_file *m = file->private_data;
+	struct mp1_status_reader *reader = m->private;
+
+	return mp1_reader_poll(file, &reader->base, wait);
+}
+
+/* Func: mp1_delta_begin
+ * Desc: Start a pass of a delta reader: take a new generation and the
+ *       removals since its previous pass. A reader that missed removals,
+ *       or is new, gets a full listing instead
+ *
+ */
+static void mp1_delta_begin(struct mp1_delta_reader *reader)
+{
+	u64 head;
+
+	reader->base.seq = ACCESS_ONCE(mp1_sweep_seq);
+	reader->gen = reader->next_gen - 1;
+	reader->next_gen = atomic_long_inc_return(&mp1_gen);
+
+	spin_lock(&mp1_tomb_lock);
+	head = mp1_tomb_head;
+	spin_unlock(&mp1_tomb_lock);
+
+	reader->resync = reader->lost || head - reader->tomb_next > MP1_TOMB_SIZE;
+	reader->lost = 0;
+	if (reader->resync) {
+		reader->gen = 0;
+		reader->tomb_from = head;
+	} else {
+		reader->tomb_from = reader->tomb_next;
+	}
+	reader->tomb_to = reader->tomb_next = head;
+}
+
+/* Func: mp1_delta_item
+ * Desc: Item at position *pos of a delta pass: the resync marker, then the
+ *       removals, then the changed entries by slot. *pos is moved to the
+ *       item found. Caller must be in an RCU read side critical section
+ *
+ */
+static void *mp1_delta_item(struct mp1_delta_reader *reader, loff_t *pos)
+{
+	loff_t hdr = reader->resync;
+	loff_t ntomb = reader->tomb_to - reader->tomb_from;
+	MP1_PROC_ENTRY *tmp;
+	unsigned int slot;
+	u64 idx;
+
+	if (*pos < hdr) {
+		return SEQ_START_TOKEN;
+	}
+
+	if (*pos < hdr + ntomb) {
+		idx = reader->tomb_from + (*pos - hdr);
+		spin_lock(&mp1_tomb_lock);
+		/* Overwritten since the pass began, resync next time */
+		if (mp1_tomb_head - idx > MP1_TOMB_SIZE) {
+			reader->lost = 1;
+		}
+		reader->tomb_pid = mp1_tomb[idx & (MP1_TOMB_SIZE - 1)];
+		spin_unlock(&mp1_tomb_lock);
+		return &reader->tomb_pid;
+	}
+
+	if (*pos - hdr - ntomb >= mp1_slots.nr) {
+		return NULL;
+	}
+	slot = *pos - hdr - ntomb;
+	while ((tmp = mp1_next_entry(&slot)) != NULL) {
+		if (reader->resync ||
+		    (long)(ACCESS_ONCE(tmp->changed_gen) - reader->gen) >= 0) {
+			break;
+		}
+		slot++;
+	}
+	*pos = hdr + ntomb + slot;
+	if (tmp == NULL) {
+		return NULL;
+	}
+
+	/* The sweep and the exit hook update the entry under the shard
+	   lock, copy it under the lock for a consistent line */
+	spin_lock(&mp1_shards[tmp->shard].lock);
+	mp1_snap_fill(&reader->item, tmp);
+	spin_unlock(&mp1_shards[tmp->shard].lock);
+	return &reader->item;
+}
+
+/* Func: mp1_delta_start
+ * Desc: Start (or resume) a delta pass at *pos. A pass starts at position
+ *       0, so collectors pread from offset 0 each time
+ *
+ */
+static void *mp1_delta_start(struct seq_file *m, loff_t *pos)
+{
+	struct mp1_delta_reader *reader = m->private;
+
+	if (*pos == 0) {
+		mp1_delta_begin(reader);
+	}
+
+	rcu_read_lock();
+	return mp1_delta_item(reader, pos);
+}
+
+/* Func: mp1_delta_stop
+ * Desc: End of a chunk, leave the RCU read side critical section
+ *
+ */
+static void mp1_delta_stop(struct seq_file *m, void *v)
+{
+	rcu_read_unlock();
+}
+
+/* Func: mp1_delta_next
+ * Desc: Advance to the item following v
+ *
+ */
+static void *mp1_delta_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	(*pos)++;
+	return mp1_delta_item(m->private, pos);
+}
+
+/* Func: mp1_delta_show
+ * Desc: Show "*" for a resync, after which the reader's state is to be
+ *       replaced by the listing that follows, "-pid" for a removal, or the
+ *       /proc/mp1/status line of a new or changed entry
+ *
+ */
+static int mp1_delta_show(struct seq_file *m, void *v)
+{
+	struct mp1_delta_reader *reader = m->private;
+
+	if (v == SEQ_START_TOKEN) {
+		seq_puts(m, "*\n");
+	} else if (v == &reader->tomb_pid) {
+		seq_printf(m, "-%u\n", reader->tomb_pid);
+	} else {
+		mp1_show_item(m, v);
+	}
+	return 0;
+}
+
+static const struct seq_operations mp1_delta_seq_ops = {
+	.start = mp1_delta_start,
+	.next = mp1_delta_next,
+	.stop = mp1_delta_stop,
+	.show = mp1_delta_show,
+};
+
+/* Func: mp1_delta_open
+ * Desc: Open /proc/mp1/delta with a fresh cursor; the first pass is a full
+ *       listing
+ *
+ */
+static int mp1_delta_open(struct inode *inode, struct file *file)
+{
+	struct mp1_delta_reader *reader;
+
+	reader = __seq_open_private(file, &mp1_delta_seq_ops, sizeof(*reader));
+	if (reader == NULL) {
+		return -ENOMEM;
+	}
+	reader->base.seq = ACCESS_ONCE(mp1_sweep_seq);
+	reader->lost = 1;
+	return 0;
+}
+
+/* Func: mp1_delta_poll
+ * Desc: poll/epoll support of /proc/mp1/delta
+ *
+ */
+static unsigned int mp1_delta_poll(struct file *file, poll_table *wait)
+{
+	struct seq_file *m = file->private_data;
+	struct mp1_delta_reader *reader = m->private;
+
+	return mp1_reader_poll(file, &reader->base, wait);
+}
+
+static const struct file_operations mp1_delta_fops = {
+	.owner = THIS_MODULE,
+	.open = mp1_delta_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release_private,
+	.poll = mp1_delta_poll,
+};
+
+/* Func: mp1_set_budget
+ * Desc: Attach the CPU budget of a registration request to a new entry.
+ *       The eventfd is looked up in the file table of the caller
+ *
+ */
+static int mp1_set_budget(MP1_PROC_ENTRY *tmp, const struct mp1_budget *budget)
+{
+	tmp->budget_ns = budget->budget_ns;
+	tmp->notify = budget->mode;
+
+	switch (budget->mode) {
+	case MP1_NOTIFY_EVENTFD:
+		tmp->efd = eventfd_ctx_fdget(budget->arg);
+		if (IS_ERR(tmp->efd)) {
+			int ret = PTR_ERR(tmp->efd);
+
+			tmp->efd = NULL;
+			return ret;
+		}
+		return 0;
+	case MP1_NOTIFY_SIGNAL:
+		/* valid_signal() also admits 0, which sends nothing */
+		if (budget->arg <= 0 || !valid_signal(budget->arg)) {
+			return -EINVAL;
+		}
+		tmp->signo = budget->arg;
+		tmp->sender_cred = get_current_cred();
+		security_task_getsecid(current, &tmp->sender_secid);
+		tmp->sender = get_pid(task_tgid(current));
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+/* Func: mp1_may_signal
+ * Desc: Whether the caller may send signals to the process of pid_ref,
+ *       by the rules of kill(2): a matching real or effective uid, or
+ *       CAP_KILL
+ *
+ */
+static int mp1_may_signal(struct pid *pid_ref)
+{
+	const struct cred *cred = current_cred(), *tcred;
+	struct task_struct *task;
+	int ok = 0;
+
+	rcu_read_lock();
+	task = pid_task(pid_ref, PIDTYPE_PID);
+	if (task) {
+		tcred = __task_cred(task);
+		ok = uid_eq(cred->euid, tcred->suid) ||
+			uid_eq(cred->euid, tcred->uid) ||
+			uid_eq(cred->uid, tcred->suid) ||
+			uid_eq(cred->uid, tcred->uid) ||
+			ns_capable(tcred->user_ns, CAP_KILL);
+	}
+	rcu_read_unlock();
+	return ok;
+}
+
+/* Func: mp1_find_group
+ * Desc: Look up a group by name. Caller must hold mp1_sem or be in an RCU
+ *       read side critical section
+ *
+ */
+static struct mp1_group *mp1_find_group(const char *name)
+{
+	struct mp1_group *group;
+
+	list_for_each_entry_rcu(group, &mp1_groups, list) {
+		if (strcmp(group->name, name) == 0) {
+			return group;
+		}
+	}
+	return NULL;
+}
+
+/* Func: mp1_group_name_valid
+ * Desc: Whether name can be a group name: 1 to MP1_GROUP_NAME_LEN - 1
+ *       printable ASCII characters other than space and ':', which
+ *       separates the name from the total in /proc/mp1/groups
+ *
+ */
+static int mp1_group_name_valid(const char *name)
+{
+	size_t len = strlen(name);
+	size_t i;
+
+	if (len == 0 || len >= MP1_GROUP_NAME_LEN) {
+		return 0;
+	}
+	for (i = 0; i < len; i++) {
+		if (name[i] <= ' ' || name[i] > '~' || name[i] == ':') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/* Func: mp1_get_group_locked
+ * Desc: Look up a group by name, creating it if needed. *created tells
+ *       whether it is new. Caller must hold mp1_sem
+ *
+ */
+static struct mp1_group *mp1_get_group_locked(const char *name, int *created)
+{
+	struct mp1_group *group;
+
+	*created = 0;
+	if (!mp1_group_name_valid(name)) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	if ((group = mp1_find_group(name)) != NULL) {
+		return group;
+	}
+
+	group = kzalloc(sizeof(*group), GFP_KERNEL);
+	if (group == NULL) {
+		return ERR_PTR(-ENOMEM);
+	}
+	strcpy(group->name, name);
+	atomic64_set(&group->cpu_ns, 0);
+	atomic_set(&group->members, 0);
+	group->owner = current_euid();
+
+	list_add_tail_rcu(&group->list, &mp1_groups);
+	*created = 1;
+	return group;
+}
+
+/* Func: mp1_delete_group_locked
+ * Desc: Delete a group, which must have no members left. Caller must hold
+ *       mp1_sem
+ *
+ */
+static int mp1_delete_group_locked(const char *name)
+{
+	struct mp1_group *group = mp1_find_group(name);
+
+	if (group == NULL) {
+		return -ENOENT;
+	}
+	if (!uid_eq(group->owner, current_euid()) && !capable(CAP_SYS_ADMIN)) {
+		return -EPERM;
+	}
+	/* Members only leave without mp1_sem, so none can join meanwhile */
+	if (atomic_read(&group->members)) {
+		return -EBUSY;
+	}
+	list_del_rcu(&group->list);
+	kfree_rcu(group, rcu);
+	return 0;
+}
+
+/* Func: mp1_group_account
+ * Desc: Add the cpu time of an entry since its last sample to its group.
+ *       Caller must hold the shard lock
+ *
+ */
+static void mp1_group_account(MP1_PROC_ENTRY *tmp)
+{
+	u64 cpu_ns = mp1_slots.cpu_ns[tmp->slot];
+
+	if (tmp->group == NULL) {
+		return;
+	}
+	/* A change of the accounting mode may move cpu_ns backwards; the
+	   delta then restarts from the new value */
+	if (cpu_ns > tmp->group_ns) {
+		atomic64_add(cpu_ns - tmp->group_ns, &tmp->group->cpu_ns);
+	}
+	tmp->group_ns = cpu_ns;
+}
+
+/* Func: mp1_register_locked
+ * Desc: Make a new entry in the list for pid, with an optional CPU budget
+ *       and group. Caller must hold mp1_sem
+ *
+ */
+static int mp1_register_locked(unsigned int pid,
+			       const struct mp1_budget *budget,
+			       struct mp1_group *group)
+{
+	MP1_PROC_ENTRY *tmp;
+	struct mp1_shard *shard;
+	struct pid *pid_ref;
+	int ret;
+
+	/* Allocate a new entry */
+	tmp = kmem_cache_alloc(mp1_entry_cache, GFP_KERNEL);
+	if (tmp == NULL) {
+		return -ENOMEM;
+	}
+
+	tmp->shard = mp1_shard_index(pid);
+	shard = &mp1_shards[tmp->shard];
+
+	/* The group's total only gets the cpu time used after joining, the
+	   baseline is sampled once the entry has its slot */
+	tmp->group = group;
+	tmp->group_ns = 0;
+
+	/* Who may unregister the entry */
+	tmp->owner = current_euid();
+
+	/* No budget unless asked for */
+	tmp->budget_ns = 0;
+	tmp->notify = 0;
+	tmp->signo = 0;
+	tmp->efd = NULL;
+	tmp->budget_fired = 0;
+	tmp->sender_cred = NULL;
+	tmp->sender = NULL;
+	if (budget && (ret = mp1_set_budget(tmp, budget)) != 0) {
+		mp1_free_entry(tmp);
+		return ret;
+	}
+
+	/* Pin the struct pid so the sweep needs no pid hash lookup */
+	pid_ref = find_get_pid(pid);
+	if (pid_ref == NULL) {
+		printk(KERN_INFO "mp1:no process with pid %u\n", pid);
+		this_cpu_inc(mp1_stats.reg_misses);
+		mp1_free_entry(tmp);
+		return -ESRCH;
+	}
+
+	/* The alarm is sent on behalf of the caller, who must be allowed to
+	   signal the process */
+	if (tmp->notify == MP1_NOTIFY_SIGNAL && !mp1_may_signal(pid_ref)) {
+		put_pid(pid_ref);
+		mp1_free_entry(tmp);
+		return -EPERM;
+	}
+
+	/* Initialize time to 0 */
+	tmp->cpu_time = tmp->user_ns = tmp->sys_ns = 0;
+	tmp->acct_mode = ACCESS_ONCE(acct_mode);
+	tmp->exited = tmp->exit_sampled = 0;
+
+	/* No previous sample yet, the first sweep takes one */
+	tmp->prev_cpu_ns = tmp->prev_stamp = 0;
+	tmp->util = 0;
+	memset(tmp->avg, 0, sizeof(tmp->avg));
+	memset(tmp->cnt, 0, sizeof(tmp->cnt));
+	memset(tmp->prev_cnt, 0, sizeof(tmp->prev_cnt));
+	memset(tmp->rate, 0, sizeof(tmp->rate));
+
+	/* Sampled on every sweep until it proves idle */
+	tmp->skip_shift = tmp->idle_samples = 0;
+
+	/* Reported as new by the delta feed */
+	tmp->changed_gen = atomic_long_read(&mp1_gen);
+
+	INIT_LIST_HEAD(&tmp->hash);
+
+	spin_lock(&shard->lock);
+
+	/* Refuse duplicate registrations */
+	if (mp1_find_entry(pid)) {
+		spin_unlock(&shard->lock);
+		printk(KERN_INFO "mp1:%u already registered\n", pid);
+		put_pid(pid_ref);
+		mp1_free_entry(tmp);
+		return -EEXIST;
+	}
+
+	/* Put the entry in a slot and in the hash table */
+	ret = mp1_add_entry(tmp, pid, pid_ref);
+	if (ret == 0 && group) {
+		atomic_inc(&group->members);
+		mp1_sample(tmp, tmp->acct_mode);
+		tmp->group_ns = mp1_slots.cpu_ns[tmp->slot];
+	}
+
+	spin_unlock(&shard->lock);
+
+	if (ret) {
+		printk(KERN_INFO "mp1:no free slot for %u\n", pid);
+		put_pid(pid_ref);
+		mp1_free_entry(tmp);
+		return ret;
+	}
+
+	/* For the first entry, start the timer */
+	if (!hrtimer_active(&mp1_timer)) {
+		printk(KERN_INFO "mp1:list is empty..starting timer\n");
+		/* Starting timer one period from now */
+		hrtimer_start(&mp1_timer, mp1_period(), HRTIMER_MODE_REL);
+	}
+
+	return 0;
+}
+
+/* Func: mp1_may_unregister
+ * Desc: Whether the caller may unregister an entry: it registered the
+ *       entry, owns the process or has CAP_SYS_ADMIN. Caller must hold the
+ *       shard lock
+ *
+ */
+static int mp1_may_unregister(MP1_PROC_ENTRY *tmp)
+{
+	kuid_t euid = current_euid();
+	struct task_struct *task;
+	int ok = uid_eq(tmp->owner, euid);
+
+	if (!ok) {
+		rcu_read_lock();
+		task = pid_task(mp1_slots.pid_ref[tmp->slot], PIDTYPE_PID);
+		ok = task && uid_eq(__task_cred(task)->uid, euid);
+		rcu_read_unlock();
+	}
+	return ok || capable(CAP_SYS_ADMIN);
+}
+
+/* Func: mp1_unregister_locked
+ * Desc: Remove the entry of pid from the list. The timer is stopped by
+ *       the next sweep if the list became empty. Caller must hold mp1_sem
+ *
+ */
+static int mp1_unregister_locked(unsigned int pid)
+{
+	struct mp1_shard *shard = &mp1_shards[mp1_shard_index(pid)];
+	MP1_PROC_ENTRY *tmp;
+
+	spin_lock(&shard->lock);
+
+	tmp = mp1_find_entry(pid);
+	if (tmp && !mp1_may_unregister(tmp)) {
+		spin_unlock(&shard->lock);
+		return -EPERM;
+	}
+	if (tmp) {
+		/* The group keeps the time used since the last sweep */
+		if (tmp->group) {
+			if (!tmp->exited) {
+				mp1_sample(tmp, tmp->acct_mode);
+			}
+			mp1_group_account(tmp);
+		}
+		mp1_remove_entry(tmp);
+	}
+
+	spin_unlock(&shard->lock);
+
+	if (tmp == NULL) {
+		printk(KERN_INFO "mp1:%u not registered\n", pid);
+		this_cpu_inc(mp1_stats.reg_misses);
+		return -ENOENT;
+	}
+	return 0;
+}
+
+/* Func: mp1_register_group_locked
+ * Desc: Register pid into the named group, creating the group if needed.
+ *       A group created for a failed registration is dropped again.
+ *       Caller must hold mp1_sem
+ *
+ */
+static int mp1_register_group_locked(unsigned int pid, const char *name)
+{
+	struct mp1_group *group;
+	int created, ret;
+
+	group = mp1_get_group_locked(name, &created);
+	if (IS_ERR(group)) {
+		return PTR_ERR(group);
+	}
+
+	ret = mp1_register_locked(pid, NULL, group);
+	if (ret && created) {
+		mp1_delete_group_locked(name);
+	}
+	return ret;
+}
+
+/* Func: mp1_apply_command_locked
+ * Desc: Apply one command of a /proc/mp1/status write. Caller must hold
+ *       mp1_sem
+ *
+ */
+static int mp1_apply_command_locked(char *line)
+{
+	char *name;
+	unsigned int pid;
+
+	if (*line == '!') {
+		return mp1_delete_group_locked(line + 1);
+	}
+
+	/* pid@group */
+	if ((name = strchr(line, '@')) != NULL) {
+		*name++ = '\0';
+	}
+
+	if (kstrtouint(line + (*line == '+' || *line == '-'), 10, &pid)) {
+		return -EINVAL;
+	}
+	if (*line == '-') {
+		return name ? -EINVAL : mp1_unregister_locked(pid);
+	}
+	if (name) {
+		return mp1_register_group_locked(pid, name);
+	}
+	return mp1_register_locked(pid, NULL, NULL);
+}
+
+/* Func: mp1_write_proc
+ * Desc: Apply a batch of newline separated commands sent by the user
+ *       process, all under one acquisition of mp1_sem:
+ *         +pid        register pid (a bare pid does the same)
+ *         +pid@group  register pid into group, created on first use
+ *         -pid        unregister pid, if the caller registered it, owns
+ *                     the process or has CAP_SYS_ADMIN
+ *         !group      delete group, which must have no members, if the
+ *                     caller created it or has CAP_SYS_ADMIN
+ *       Stops at the first failed command and returns the bytes before
+ *       its line, like a short write, or its error if it is the first
+ *       line; the writer learns the error when it sends the rest again.
+ *       Returns len if all commands applied
+ *
+ */
+ssize_t mp1_write_proc(struct file *filp, const char __user *buff,
+		       size_t len, loff_t *off)
+{
+	char *page, *cur, *line;
+	int ret = 0, truncated = 0;
+	size_t done = 0;
+
+	/* Up to a page worth of commands per write */
+	if (len > PAGE_SIZE - 1) {
+		len = PAGE_SIZE - 1;
+		truncated = 1;
+	}
+
+	page = (char *)__get_free_page(GFP_KERNEL);
+	if (page == NULL) {
+		return -ENOMEM;
+	}
+
+	/* Copy the commands sent by the user process into kernel buffer */
+	if (copy_from_user(page, buff, len)) {
+		free_page((unsigned long)page);
+		return -EFAULT;
+	}
+	page[len] = '\0';
+
+	/* Do not apply a command cut in half, the writer sends it again with
+	   the rest of the batch */
+	if (truncated && (cur = strrchr(page, '\n')) != NULL) {
+		*++cur = '\0';
+		len = cur - page;
+	}
+
+	/* Enter critical region */
+	if (mp1_sem_down()) {
+		printk(KERN_INFO "mp1:Unable to enter critical region\n");
+		free_page((unsigned long)page);
+		return -EINTR;
+	}
+
+	cur = page;
+	while ((line = strsep(&cur, "\n")) != NULL) {
+		/* Bytes before this line */
+		done = line - page;
+		line = strim(line);
+		if (*line == '\0') {
+			continue;
+		}
+
+		if ((ret = mp1_apply_command_locked(line)) != 0) {
+			break;
+		}
+	}
+
+	/* Exit critical region */
+	up(&mp1_sem);
+
+	free_page((unsigned long)page);
+
+	if (ret != 0) {
+		return done ? done : ret;
+	}
+	return len;
+}
+
+/* Func: mp1_groups_start
+ * Desc: Start (or resume) a pass over the groups at position *pos, under
+ *       the RCU read lock until mp1_groups_stop
+ *
+ */
+static void *mp1_groups_start(struct seq_file *m, loff_t *pos)
+{
+	struct mp1_group *group;
+	loff_t off = *pos;
+
+	rcu_read_lock();
+
+	list_for_each_entry_rcu(group, &mp1_groups, list) {
+		if (off-- == 0) {
+			return group;
+		}
+	}
+	return NULL;
+}
+
+/* Func: mp1_groups_next
+ * Desc: Advance to the group following v
+ *
+ */
+static void *mp1_groups_next(struct seq_file *m, void *v, loff_t *pos)
+{
+	struct mp1_group *group = v;
+	struct list_head *next = rcu_dereference(group->list.next);
+
+	(*pos)++;
+	if (next == &mp1_groups) {
+		return NULL;
+	}
+	return list_entry(next, struct mp1_group, list);
+}
+
+/* Func: mp1_groups_stop
+ * Desc: End of a chunk, leave the RCU read side critical section
+ *
+ */
+static void mp1_groups_stop(struct seq_file *m, void *v)
+{
+	rcu_read_unlock();
+}
+
+/* Func: mp1_groups_show
+ * Desc: Provide name, total cpu time in ns and number of registered
+ *       members of one group
+ *
+ */
+static int mp1_groups_show(struct seq_file *m, void *v)
+{
+	struct mp1_group *group = v;
+
+	seq_printf(m, "%s:%llu %d\n", group->name,
+		   (unsigned long long)atomic64_read(&group->cpu_ns),
+		   atomic_read(&group->members));
+	return 0;
+}
+
+static const struct seq_operations mp1_groups_seq_ops = {
+	.start = mp1_groups_start,
+	.next = mp1_groups_next,
+	.stop = mp1_groups_stop,
+	.show = mp1_groups_show,
+};
+
+/* Func: mp1_groups_open
+ * Desc: Open /proc/mp1/groups as a seq_file
+ *
+ */
+static int mp1_groups_open(struct inode *inode, struct file *file)
+{
+	return seq_open(file, &mp1_groups_seq_ops);
+}
+
+static const struct file_operations mp1_groups_fops = {
+	.owner = THIS_MODULE,
+	.open = mp1_groups_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = seq_release,
+};
+
+static const struct file_operations mp1_proc_fops = {
+	.owner = THIS_MODULE,
+	.open = mp1_proc_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = mp1_proc_release,
+	.write = mp1_write_proc,
+	.poll = mp1_proc_poll,
+};
+
+/* Func: mp1_ring_alloc
+ * Desc: Allocate the history ring to share with user
+ *
+ */
+static int mp1_ring_alloc(void)
+{
+	unsigned long size = (unsigned long)(ring_pages + 1) * PAGE_SIZE;
+	unsigned long i;
+
+	if (ring_pages == 0) {
+		return -EINVAL;
+	}
+
+	if ((mp1_ring = vzalloc(size)) == NULL) {
+		return -ENOMEM;
+	}
+	mp1_ring_stage = vmalloc(mp1_slots.nr * sizeof(*mp1_ring_stage));
+	if (mp1_ring_stage == NULL) {
+		vfree(mp1_ring);
+		mp1_ring = NULL;
+		return -ENOMEM;
+	}
+
+	/* Set PG_RESERVED bit of pages to avoid MMU from swapping out the pages */
+	for (i = 0; i < size; i += PAGE_SIZE) {
+		SetPageReserved(vmalloc_to_page(mp1_ring + i));
+	}
+
+	mp1_ring_hdr = mp1_ring;
+	mp1_ring_recs = mp1_ring + PAGE_SIZE;
+	mp1_ring_cap = ring_pages * PAGE_SIZE / sizeof(struct mp1_record);
+	mp1_ring_hdr->capacity = mp1_ring_cap;
+	mp1_ring_hdr->record_size = sizeof(struct mp1_record);
+	return 0;
+}
+
+/* Func: mp1_ring_free
+ * Desc: Free the history ring
+ *
+ */
+static void mp1_ring_free(void)
+{
+	unsigned long size = (unsigned long)(ring_pages + 1) * PAGE_SIZE;
+	unsigned long i;
+
+	if (mp1_ring == NULL) {
+		return;
+	}
+
+	/* Clear the PG_RESERVED bits of the pages */
+	for (i = 0; i < size; i += PAGE_SIZE) {
+		ClearPageReserved(vmalloc_to_page(mp1_ring + i));
+	}
+	vfree(mp1_ring);
+	mp1_ring = NULL;
+	vfree(mp1_ring_stage);
+	mp1_ring_stage = NULL;
+}
+
+/* Func: mp1_ring_write
+ * Desc: Write a record at producer index *prod, which must have been
+ *       reserved, and advance *prod
+ *
+ */
+static void mp1_ring_write(u64 *prod, const struct mp1_record *src)
+{
+	u32 idx;
+
+	/* Overwriting a record the reader has not consumed yet */
+	if (*prod - ACCESS_ONCE(mp1_ring_hdr->consumer) >= mp1_ring_cap) {
+		atomic64_inc(&mp1_ring_lost);
+	}
+
+	div_u64_rem(*prod, mp1_ring_cap, &idx);
+	mp1_ring_recs[idx] = *src;
+	(*prod)++;
+}
+
+/* Func: mp1_ring_append
+ * Desc: Stage the current sample of an entry in a shard's cursor
+ *
+ */
+static void mp1_ring_append(MP1_PROC_ENTRY *tmp, struct mp1_ring_cursor *cur)
+{
+	struct mp1_record *rec = &cur->recs[cur->nr++];
+
+	rec->pid = mp1_slots.pid[tmp->slot];
+	rec->pad = 0;
+	rec->cpu_time = mp1_slots.cpu_ns[tmp->slot];
+	rec->timestamp = tmp->prev_stamp;
+}
+
+/* Func: mp1_ring_flush
+ * Desc: Reserve ring slots for exactly the records a shard staged, with a
+ *       single update of the shared producer index, and write them. The
+ *       reservation is published before any slot is overwritten
+ *
+ */
+static void mp1_ring_flush(struct mp1_ring_cursor *cur)
+{
+	unsigned int i;
+	u64 prod;
+
+	if (cur->nr == 0) {
+		return;
+	}
+
+	spin_lock(&mp1_ring_lock);
+	prod = mp1_ring_prod;
+	mp1_ring_prod += cur->nr;
+	ACCESS_ONCE(mp1_ring_hdr->reserved) = mp1_ring_prod;
+	spin_unlock(&mp1_ring_lock);
+
+	/* Readers must see the reservation before the records it covers */
+	smp_wmb();
+
+	for (i = 0; i < cur->nr; i++) {
+		mp1_ring_write(&prod, &cur->recs[i]);
+	}
+}
+
+/* Func: mp1_ring_publish
+ * Desc: Make the records appended by a sweep visible to readers. Called
+ *       once all shard sweeps have completed
+ *
+ */
+static void mp1_ring_publish(void)
+{
+	mp1_ring_hdr->lost = atomic64_read(&mp1_ring_lost);
+	/* Records must be visible before the index that covers them */
+	smp_wmb();
+	ACCESS_ONCE(mp1_ring_hdr->producer) = mp1_ring_prod;
+}
+
+/* Func: mp1_dev_mmap
+ * Desc: MMAP the history ring in user address space. Only the header page
+ *       may be mapped writable, for the reader to store its consumer index
+ *
+ */
+static int mp1_dev_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	unsigned long length = vma->vm_end - vma->vm_start;
+	void *start = mp1_ring + (vma->vm_pgoff << PAGE_SHIFT);
+	unsigned long i;
+	int ret;
+
+	if (vma->vm_pgoff > ring_pages ||
+	    vma_pages(vma) > ring_pages + 1 - vma->vm_pgoff) {
+		return -EINVAL;
+	}
+
+	/* The records are for the module alone to write */
+	if (vma->vm_pgoff + vma_pages(vma) > 1) {
+		if (vma->vm_flags & VM_WRITE) {
+			return -EPERM;
+		}
+		vma->vm_flags &= ~VM_MAYWRITE;
+	}
+
+	/* Done for every page */
+	for (i = 0; i < length; i += PAGE_SIZE) {
+		/* Remap every page in the virtual address space of the user
+		   process */
+		if ((ret = remap_pfn_range(vma,
+					   vma->vm_start + i,
+					   vmalloc_to_pfn(start + i),
+					   PAGE_SIZE,
+					   vma->vm_page_prot)) < 0) {
+			printk(KERN_INFO "mp1:mmap failed\n");
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* Func: mp1_dev_read
+ * Desc: Copy a packed array of struct mp1_record to the user, starting at
+ *       record *ppos / sizeof(struct mp1_record). The records are gathered
+ *       in one RCU pass and copied out afterwards
+ *
+ */
+static ssize_t mp1_dev_read(struct file *filp, char __user *buff,
+			    size_t len, loff_t *ppos)
+{
+	struct mp1_reader *reader = filp->private_data;
+	struct mp1_snap_item *item;
+	struct mp1_record *recs;
+	struct mp1_snap *snap;
+	unsigned int i, j;
+	size_t nr, n = 0;
+	loff_t skip;
+	ssize_t ret;
+
+	if (*ppos % sizeof(*recs)) {
+		return -EINVAL;
+	}
+	skip = *ppos / sizeof(*recs);
+
+	/* A read from the start sees the data of the latest sweep */
+	if (skip == 0) {
+		reader->seq = ACCESS_ONCE(mp1_sweep_seq);
+	}
+
+	/* No more records than there are entries */
+	nr = min_t(size_t, len / sizeof(*recs), atomic_read(&mp1_nr_entries));
+	if (nr == 0) {
+		return 0;
+	}
+
+	recs = vmalloc(nr * sizeof(*recs));
+	if (recs == NULL) {
+		return -ENOMEM;
+	}
+
+	/* Records of one read all come from the same snapshot */
+	rcu_read_lock();
+	snap = rcu_dereference(mp1_snap);
+	for (i = 0; snap && i < MP1_NR_SHARDS && n < nr; i++) {
+		if (skip >= snap->nr[i]) {
+			skip -= snap->nr[i];
+			continue;
+		}
+		for (j = skip; j < snap->nr[i] && n < nr; j++) {
+			item = &snap->items[i * mp1_slots.per_shard + j];
+			recs[n].pid = item->pid;
+			recs[n].pad = 0;
+			recs[n].cpu_time = item->cpu_ns;
+			recs[n].timestamp = item->stamp;
+			n++;
+		}
+		skip = 0;
+	}
+	rcu_read_unlock();
+
+	ret = n * sizeof(*recs);
+	if (copy_to_user(buff, recs, ret)) {
+		ret = -EFAULT;
+	} else {
+		*ppos += ret;
+	}
+
+	vfree(recs);
+	return ret;
+}
+
+/* Func: mp1_dev_ioctl
+ * Desc: Register or unregister the pid passed by the user, possibly with a
+ *       CPU budget or into a group, or return the sweep sequence number
+ *
+ */
+static long mp1_dev_ioctl(struct file *filp, unsigned int cmd,
+			  unsigned long arg)
+{
+	struct mp1_reader *reader = filp->private_data;
+	struct mp1_budget budget;
+	struct mp1_group_reg reg;
+	__u32 pid;
+	long ret;
+
+	switch (cmd) {
+	case MP1_IOC_SEQ:
+		reader->seq = ACCESS_ONCE(mp1_sweep_seq);
+		return put_user((__u64)reader->seq, (__u64 __user *)arg);
+	case MP1_IOC_REGISTER:
+	case MP1_IOC_UNREGISTER:
+		if (get_user(pid, (__u32 __user *)arg)) {
+			return -EFAULT;
+		}
+
+		/* Enter critical region */
+		if (mp1_sem_down()) {
+			return -EINTR;
+		}
+
+		if (cmd == MP1_IOC_REGISTER) {
+			ret = mp1_register_locked(pid, NULL, NULL);
+		} else {
+			ret = mp1_unregister_locked(pid);
+		}
+
+		/* Exit critical region */
+		up(&mp1_sem);
+		return ret;
+	case MP1_IOC_REGISTER_BUDGET:
+		if (copy_from_user(&budget, (void __user *)arg, sizeof(budget))) {
+			return -EFAULT;
+		}
+		if (budget.budget_ns == 0) {
+			return -EINVAL;
+		}
+
+		/* Enter critical region */
+		if (mp1_sem_down()) {
+			return -EINTR;
+		}
+
+		ret = mp1_register_locked(budget.pid, &budget, NULL);
+
+		/* Exit critical region */
+		up(&mp1_sem);
+		return ret;
+	case MP1_IOC_REGISTER_GROUP:
+		if (copy_from_user(&reg, (void __user *)arg, sizeof(reg))) {
+			return -EFAULT;
+		}
+		if (memchr(reg.name, '\0', sizeof(reg.name)) == NULL) {
+			return -EINVAL;
+		}
+
+		/* Enter critical region */
+		if (mp1_sem_down()) {
+			return -EINTR;
+		}
+
+		ret = mp1_register_group_locked(reg.pid, reg.name);
+
+		/* Exit critical region */
+		up(&mp1_sem);
+		return ret;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Func: mp1_dev_open
+ * Desc: Allocate the per file reader state
+ *
+ */
+static int mp1_dev_open(struct inode *inode, struct file *filp)
+{
+	struct mp1_reader *reader = kzalloc(sizeof(*reader), GFP_KERNEL);
+
+	if (reader == NULL) {
+		return -ENOMEM;
+	}
+	reader->seq = ACCESS_ONCE(mp1_sweep_seq);
+	filp->private_data = reader;
+	return 0;
+}
+
+/* Func: mp1_dev_release
+ * Desc: Free the per file reader state
+ *
+ */
+static int mp1_dev_release(struct inode *inode, struct file *filp)
+{
+	kfree(filp->private_data);
+	return 0;
+}
+
+/* Func: mp1_dev_poll
+ * Desc: poll/epoll support of /dev/mp1
+ *
+ */
+static unsigned int mp1_dev_poll(struct file *filp, poll_table *wait)
+{
+	return mp1_reader_poll(filp, filp->private_data, wait);
+}
+
+#ifdef CONFIG_COMPAT
+/* Func: mp1_dev_compat_ioctl
+ * Desc: ioctl of 32 bit processes. The argument structs have the same
+ *       layout in both ABIs, only the user pointer needs converting
+ *
+ */
+static long mp1_dev_compat_ioctl(struct file *filp, unsigned int cmd,
+				 unsigned long arg)
+{
+	return mp1_dev_ioctl(filp, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+static const struct file_operations mp1_dev_fops = {
+	.owner = THIS_MODULE,
+	.open = mp1_dev_open,
+	.release = mp1_dev_release,
+	.poll = mp1_dev_poll,
+	.read = mp1_dev_read,
+	.llseek = default_llseek,
+	.unlocked_ioctl = mp1_dev_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = mp1_dev_compat_ioctl,
+#endif
+	.mmap = mp1_dev_mmap,
+};
+
+/* Func: mp1_create_char_dev
+ * Desc: Create the character device and its /dev/mp1 node
+ *
+ */
+static int mp1_create_char_dev(void)
+{
+	int result;
+
+	/* Dynamically allocate a major number for the device */
+	result = alloc_chrdev_region(&mp1_dev, 0, 1, "mp1");
+	if (result < 0) {
+		printk(KERN_INFO "mp1: Char dev cannot get major\n");
+		return result;
+	}
+
+	/* Allocate a character device structure */
+	mp1_cdev = cdev_alloc();
+	if (mp1_cdev == NULL) {
+		result = -ENOMEM;
+		goto unregister;
+	}
+	/* Assign the function pointers */
+	mp1_cdev->ops = &mp1_dev_fops;
+	mp1_cdev->owner = THIS_MODULE;
+
+	/* Add this character device */
+	result = cdev_add(mp1_cdev, mp1_dev, 1);
+	if (result) {
+		printk(KERN_INFO "mp1: Error adding device\n");
+		kobject_put(&mp1_cdev->kobj);
+		goto unregister;
+	}
+
+	/* Let udev create /dev/mp1 */
+	mp1_class = class_create(THIS_MODULE, "mp1");
+	if (IS_ERR(mp1_class)) {
+		result = PTR_ERR(mp1_class);
+		goto del_cdev;
+	}
+	mp1_device = device_create(mp1_class, NULL, mp1_dev, NULL, "mp1");
+	if (IS_ERR(mp1_device)) {
+		result = PTR_ERR(mp1_device);
+		goto destroy_class;
+	}
+	return 0;
+
+ destroy_class:
+	class_destroy(mp1_class);
+ del_cdev:
+	cdev_del(mp1_cdev);
+ unregister:
+	unregister_chrdev_region(mp1_dev, 1);
+	mp1_cdev = NULL;
+	return result;
+}
+
+/* Func: mp1_delete_char_dev
+ * Desc: Delete character device
+ *
+ */
+static void mp1_delete_char_dev(void)
+{
+	device_destroy(mp1_class, mp1_dev);
+	class_destroy(mp1_class);
+	/* Delete the character device */
+	cdev_del(mp1_cdev);
+	/* Unregister the character device */
+	unregister_chrdev_region(mp1_dev, 1);
+}
+
+/* Func: mp1_per_sec
+ * Desc: Rate per second of a counter that grew by delta in wall ns
+ *
+ */
+static u64 mp1_per_sec(u64 delta, u64 wall)
+{
+	/* Keep delta * NSEC_PER_SEC from overflowing */
+	while (delta >= (1ULL << 34)) {
+		delta >>= 1;
+		wall >>= 1;
+	}
+	return wall ? div64_u64(delta * NSEC_PER_SEC, wall) : 0;
+}
+
+/* Func: mp1_update_rates
+ * Desc: Derive the utilization and the counter rates since the previous
+ *       sample of an entry and fold the utilization into the averages.
+ *       Caller must hold the shard lock
+ *
+ */
+static void mp1_update_rates(MP1_PROC_ENTRY *tmp, u64 now)
+{
+	u64 cpu_ns = mp1_slots.cpu_ns[tmp->slot];
+	u64 delta_cpu, delta_wall, period_ns, decay;
+	unsigned long periods;
+	int i;
+
+	if (tmp->prev_stamp == 0 || now <= tmp->prev_stamp) {
+		goto out;
+	}
+
+	delta_cpu = cpu_ns > tmp->prev_cpu_ns ? cpu_ns - tmp->prev_cpu_ns : 0;
+	delta_wall = now - tmp->prev_stamp;
+
+	for (i = 0; i < MP1_NR_CNT; i++) {
+		tmp->rate[i] = mp1_per_sec(tmp->cnt[i] > tmp->prev_cnt[i] ?
+					   tmp->cnt[i] - tmp->prev_cnt[i] : 0,
+					   delta_wall);
+	}
+
+	/* Keep delta_cpu << MP1_FSHIFT from overflowing */
+	while (delta_cpu >= (1ULL << (63 - MP1_FSHIFT))) {
+		delta_cpu >>= 1;
+		delta_wall >>= 1;
+	}
+	tmp->util = div64_u64(delta_cpu << MP1_FSHIFT, delta_wall) * 100;
+
+	/* Number of sampling periods this sample stands for */
+	period_ns = (u64)period_ms * NSEC_PER_MSEC;
+	periods = div64_u64(delta_wall + period_ns / 2, period_ns);
+	if (periods == 0) {
+		periods = 1;
+	}
+
+	for (i = 0; i < MP1_NR_AVG; i++) {
+		decay = periods == 1 ? mp1_avg_decay[i] :
+			mp1_fixed_pow(mp1_avg_decay[i], periods);
+		tmp->avg[i] = (tmp->avg[i] * decay +
+			       tmp->util * (MP1_EXP_1 - decay)) >> MP1_EXP_SHIFT;
+	}
+ out:
+	tmp->prev_cpu_ns = cpu_ns;
+	tmp->prev_stamp = now;
+	memcpy(tmp->prev_cnt, tmp->cnt, sizeof(tmp->prev_cnt));
+}
+
+/* Func: mp1_adapt_interval
+ * Desc: Adjust the sampling interval of an entry after a sample that did
+ *       or did not see its cpu time change. Caller must hold the shard lock
+ *
+ */
+static void mp1_adapt_interval(MP1_PROC_ENTRY *tmp, int changed)
+{
+	unsigned int max_shift = min_t(unsigned int,
+				       ACCESS_ONCE(adapt_max_shift),
+				       MP1_ADAPT_SHIFT_LIMIT);
+
+	if (changed) {
+		/* Busy again, snap back to sampling every sweep */
+		tmp->skip_shift = 0;
+		tmp->idle_samples = 0;
+	} else if (++tmp->idle_samples >= ACCESS_ONCE(adapt_idle_samples) &&
+		   tmp->skip_shift < max_shift) {
+		tmp->skip_shift++;
+		tmp->idle_samples = 0;
+	}
+
+	mp1_slots.next_sample[tmp->slot] = mp1_sweep.seq + (1UL << tmp->skip_shift);
+}
+
+/* Func: mp1_period_show
+ * Desc: Show the sampling period in milliseconds
+ *
+ */
+static int mp1_period_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "%u\n", ACCESS_ONCE(period_ms));
+	return 0;
+}
+
+/* Func: mp1_period_open
+ * Desc: Open /proc/mp1/period
+ *
+ */
+static int mp1_period_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mp1_period_show, NULL);
+}
+
+/* Func: mp1_period_write
+ * Desc: Set the sampling period in milliseconds. Needs CAP_SYS_ADMIN like
+ *       the period_ms module parameter, a short period costs every CPU
+ *
+ */
+static ssize_t mp1_period_write(struct file *filp, const char __user *buff,
+				size_t len, loff_t *off)
+{
+	unsigned int ms;
+	int ret;
+
+	if (!capable(CAP_SYS_ADMIN)) {
+		return -EPERM;
+	}
+
+	if ((ret = kstrtouint_from_user(buff, len, 0, &ms)) != 0) {
+		return ret;
+	}
+
+	if ((ret = mp1_set_period(ms)) != 0) {
+		return ret;
+	}
+
+	return len;
+}
+
+static const struct file_operations mp1_period_fops = {
+	.owner = THIS_MODULE,
+	.open = mp1_period_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = mp1_period_write,
+};
+
+/* Func: mp1_seqno_show
+ * Desc: Show the number of completed sweeps, the value MP1_IOC_SEQ
+ *       returns on /dev/mp1
+ *
+ */
+static int mp1_seqno_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "%lu\n", ACCESS_ONCE(mp1_sweep_seq));
+	return 0;
+}
+
+/* Func: mp1_seqno_open
+ * Desc: Open /proc/mp1/seq
+ *
+ */
+static int mp1_seqno_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mp1_seqno_show, NULL);
+}
+
+static const struct file_operations mp1_seqno_fops = {
+	.owner = THIS_MODULE,
+	.open = mp1_seqno_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Func: mp1_stats_sum
+ * Desc: Sum the statistics of all CPUs into *sum
+ *
+ */
+static void mp1_stats_sum(struct mp1_stats *sum)
+{
+	const u64 *src;
+	u64 *dst = (u64 *)sum;
+	unsigned int i;
+	int cpu;
+
+	/* struct mp1_stats is all u64 counters */
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		src = (const u64 *)per_cpu_ptr(&mp1_stats, cpu);
+		for (i = 0; i < sizeof(*sum) / sizeof(u64); i++) {
+			dst[i] += ACCESS_ONCE(src[i]);
+		}
+	}
+}
+
+/* Func: mp1_hist_show
+ * Desc: Print count and sum of a histogram and its non empty buckets as
+ *       "<name>_bucket <low> <high> <count>", high being exclusive
+ *
+ */
+static void mp1_hist_show(struct seq_file *m, const char *name,
+			  const struct mp1_hist *hist)
+{
+	u64 count = 0;
+	int i;
+
+	for (i = 0; i < MP1_HIST_BUCKETS; i++) {
+		count += hist->count[i];
+	}
+	seq_printf(m, "%s_count %llu\n%s_sum %llu\n", name, count, name,
+		   hist->sum);
+
+	for (i = 0; i < MP1_HIST_BUCKETS; i++) {
+		if (hist->count[i] == 0) {
+			continue;
+		}
+		seq_printf(m, "%s_bucket %llu %llu %llu\n", name,
+			   i ? 1ULL << (i - 1) : 0ULL,
+			   i < MP1_HIST_BUCKETS - 1 ? 1ULL << i : ~0ULL,
+			   hist->count[i]);
+	}
+}
+
+/* Func: mp1_stats_show
+ * Desc: Show the counters and histograms summed over all CPUs
+ *
+ */
+static int mp1_stats_show(struct seq_file *m, void *v)
+{
+	struct mp1_stats *sum;
+
+	/* Too large for the stack with the histograms */
+	sum = kmalloc(sizeof(*sum), GFP_KERNEL);
+	if (sum == NULL) {
+		return -ENOMEM;
+	}
+	mp1_stats_sum(sum);
+
+	seq_printf(m, "entries %d\n", atomic_read(&mp1_nr_entries));
+	seq_printf(m, "sweeps %llu\n", sum->sweeps);
+	seq_printf(m, "visited %llu\n", sum->visited);
+	seq_printf(m, "sampled %llu\n", sum->sampled);
+	seq_printf(m, "skipped %llu\n", sum->skipped);
+	seq_printf(m, "dead %llu\n", sum->dead);
+	seq_printf(m, "exit_lookups %llu\n", sum->exit_lookups);
+	seq_printf(m, "exit_misses %llu\n", sum->exit_misses);
+	seq_printf(m, "reg_misses %llu\n", sum->reg_misses);
+	seq_printf(m, "budget_alarms %llu\n", sum->budget_alarms);
+	mp1_hist_show(m, "sweep_ns", &sum->sweep_ns);
+	mp1_hist_show(m, "sweep_entries", &sum->sweep_entries);
+	mp1_hist_show(m, "sem_wait_ns", &sum->sem_wait_ns);
+	mp1_hist_show(m, "timer_late_ns", &sum->timer_late_ns);
+
+	kfree(sum);
+	return 0;
+}
+
+/* Func: mp1_stats_open
+ * Desc: Open /proc/mp1/stats
+ *
+ */
+static int mp1_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mp1_stats_show, NULL);
+}
+
+/* Func: mp1_stats_write
+ * Desc: Any write clears the statistics, to start a measurement afresh.
+ *       Updates racing with the clear may survive it. Needs
+ *       CAP_SYS_ADMIN, as it wipes every user's measurement
+ *
+ */
+static ssize_t mp1_stats_write(struct file *filp, const char __user *buff,
+			       size_t len, loff_t *off)
+{
+	int cpu;
+
+	if (!capable(CAP_SYS_ADMIN)) {
+		return -EPERM;
+	}
+
+	for_each_possible_cpu(cpu) {
+		memset(per_cpu_ptr(&mp1_stats, cpu), 0, sizeof(struct mp1_stats));
+	}
+	return len;
+}
 
-/* Kernel Thread */
-static struct task_struct *mp1_kernel_thread;
+static const struct file_operations mp1_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = mp1_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+	.write = mp1_stats_write,
+};
 
-/* Wait queue for kernel thread to wait on */
-static DECLARE_WAIT_QUEUE_HEAD (mp1_waitqueue);
+/* Func: mp1_check_budget
+ * Desc: Notify once the cpu time of an entry crossed its budget. Caller
+ *       must hold the shard lock
+ *
+ */
+static void mp1_check_budget(MP1_PROC_ENTRY *tmp)
+{
+	u64 cpu_ns = mp1_slots.cpu_ns[tmp->slot];
+	struct siginfo info;
 
-/* Timer for waking kernel thread periodically */
-static struct timer_list mp1_timer;
+	if (tmp->budget_ns == 0 || tmp->budget_fired || cpu_ns < tmp->budget_ns) {
+		return;
+	}
+	tmp->budget_fired = 1;
+	this_cpu_inc(mp1_stats.budget_alarms);
 
-/* Semaphore for synchronization on the list */
-static struct semaphore mp1_sem;
+	printk(KERN_INFO "mp1:%u crossed its cpu budget, %llu of %llu ns\n",
+	       mp1_slots.pid[tmp->slot], cpu_ns, tmp->budget_ns);
 
-/* Func: mp1_timer_callback
- * Desc: Timer callback to just wake up the kernel thread
+	if (tmp->notify == MP1_NOTIFY_EVENTFD) {
+		eventfd_signal(tmp->efd, 1);
+	} else if (!tmp->exited) {
+		/* Sent as if by the registering process, so the kill(2) rules
+		   are applied to its credentials and not to the kworker's; a
+		   process that since changed its ids, e.g. by a setuid exec,
+		   is not signalled */
+		memset(&info, 0, sizeof(info));
+		info.si_signo = tmp->signo;
+		info.si_code = SI_USER;
+		info.si_pid = pid_nr(tmp->sender);
+		info.si_uid = from_kuid_munged(tmp->sender_cred->user_ns,
+					       tmp->sender_cred->uid);
+		kill_pid_info_as_cred(tmp->signo, &info,
+				      mp1_slots.pid_ref[tmp->slot],
+				      tmp->sender_cred, tmp->sender_secid);
+	}
+}
+
+/* Func: mp1_top_less
+ * Desc: Order of the top list: by utilization, then by pid
  *
  */
-void mp1_timer_callback(unsigned long data)
+static inline int mp1_top_less(const struct mp1_top_item *a,
+			       const struct mp1_top_item *b)
 {
-	/* Put the kernel thread into running state */
-	wake_up_interruptible(&mp1_waitqueue);
+	return a->util < b->util || (a->util == b->util && a->pid > b->pid);
 }
 
-/* Func: mp1_read_proc
- * Desc: Read the list and provide pid and cpu time of each registered
- *       process to the user
+/* Func: mp1_top_sift_down
+ * Desc: Restore the min heap property of heap[0..nr) below index i
  *
  */
-int mp1_read_proc(char *page, char **start, off_t off,
-		  int count, int *eof, void *data)
+static void mp1_top_sift_down(struct mp1_top_item *heap, unsigned int nr,
+			      unsigned int i)
 {
-	int len = 0;
-	MP1_PROC_ENTRY *tmp;
+	struct mp1_top_item tmp;
+	unsigned int child;
 
-	/* Enter critical region */
-	if (down_interruptible(&mp1_sem)) {
-		printk(KERN_INFO "mp1:unable to obtain sem\n");
-		return 0;
+	while ((child = 2 * i + 1) < nr) {
+		if (child + 1 < nr && mp1_top_less(&heap[child + 1], &heap[child])) {
+			child++;
+		}
+		if (!mp1_top_less(&heap[child], &heap[i])) {
+			break;
+		}
+		tmp = heap[i];
+		heap[i] = heap[child];
+		heap[child] = tmp;
+		i = child;
+	}
+}
+
+/* Func: mp1_top_push
+ * Desc: Offer an item to a min heap of at most k items, which keeps the k
+ *       largest. O(log k)
+ *
+ */
+static void mp1_top_push(struct mp1_top_item *heap, unsigned int *nr,
+			 unsigned int k, const struct mp1_top_item *item)
+{
+	struct mp1_top_item tmp;
+	unsigned int i, parent;
+
+	if (*nr < k) {
+		/* Sift the new item up from the end */
+		i = (*nr)++;
+		heap[i] = *item;
+		while (i > 0) {
+			parent = (i - 1) / 2;
+			if (!mp1_top_less(&heap[i], &heap[parent])) {
+				break;
+			}
+			tmp = heap[i];
+			heap[i] = heap[parent];
+			heap[parent] = tmp;
+			i = parent;
+		}
+	} else if (k && mp1_top_less(&heap[0], item)) {
+		/* Replace the smallest */
+		heap[0] = *item;
+		mp1_top_sift_down(heap, *nr, 0);
 	}
+}
 
-	/* Traverse the list and put values into page */
-	list_for_each_entry(tmp, &mp1_proc_list.list, list) {
-		len += sprintf(page+len, "%u:%lu\n",tmp->pid, tmp->cpu_time);
+/* Func: mp1_top_cmp
+ * Desc: sort() comparator putting the busiest first
+ *
+ */
+static int mp1_top_cmp(const void *a, const void *b)
+{
+	if (mp1_top_less(a, b)) {
+		return 1;
 	}
+	return mp1_top_less(b, a) ? -1 : 0;
+}
 
-	/* Exit critical region */
-	up(&mp1_sem);
+/* Func: mp1_top_publish
+ * Desc: Merge the shard heaps of the last sweep into a new top list and
+ *       replace the published one. O(shards * k log k)
+ *
+ */
+static void mp1_top_publish(void)
+{
+	struct mp1_top *top, *old;
+	unsigned int i, j;
 
-	/* Return length of data being sent */
-	return len;
+	top = kmalloc(sizeof(*top) + top_k * sizeof(top->items[0]), GFP_KERNEL);
+	if (top == NULL) {
+		return;
+	}
+	top->nr = 0;
+
+	/* The shard work items are done, their heaps are stable */
+	for (i = 0; i < MP1_NR_SHARDS; i++) {
+		for (j = 0; j < mp1_shards[i].top_nr; j++) {
+			mp1_top_push(top->items, &top->nr, top_k,
+				     &mp1_shards[i].top[j]);
+		}
+	}
+	sort(top->items, top->nr, sizeof(top->items[0]), mp1_top_cmp, NULL);
+
+	old = rcu_dereference_protected(mp1_top, 1);
+	rcu_assign_pointer(mp1_top, top);
+	if (old) {
+		kfree_rcu(old, rcu);
+	}
 }
 
-/* Func: mp1_write_proc
- * Desc: Copy the pid sent from user process and make a new entry in the
- *       list
+/* Func: mp1_snap_new
+ * Desc: Allocate a snapshot buffer, one item per slot, and put it on the
+ *       idle list. Called by the kernel thread or at load only
  *
  */
-int mp1_write_proc(struct file *filp, const char __user *buff,
-		   unsigned long len, void *data)
+static int mp1_snap_new(void)
+{
+	struct mp1_snap *snap;
+
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (snap == NULL) {
+		return -ENOMEM;
+	}
+	snap->items = vzalloc(mp1_slots.nr * sizeof(*snap->items));
+	if (snap->items == NULL) {
+		kfree(snap);
+		return -ENOMEM;
+	}
+	mp1_snaps[mp1_nr_snaps++] = snap;
+	llist_add(&snap->idle, &mp1_snap_idle);
+	return 0;
+}
+
+/* Func: mp1_snap_get
+ * Desc: Take an idle snapshot buffer for the sweep to build. If readers
+ *       may still be copying all the others, allocate one more, and past
+ *       MP1_NR_SNAPS_MAX return NULL: the sweep then keeps the published
+ *       snapshot rather than wait for a grace period
+ *
+ */
+static struct mp1_snap *mp1_snap_get(void)
+{
+	struct llist_node *node;
+
+	/* The kernel thread is the only consumer of the idle list */
+	node = llist_del_first(&mp1_snap_idle);
+	if (node == NULL && mp1_nr_snaps < MP1_NR_SNAPS_MAX &&
+	    mp1_snap_new() == 0) {
+		node = llist_del_first(&mp1_snap_idle);
+	}
+	return node ? llist_entry(node, struct mp1_snap, idle) : NULL;
+}
+
+/* Func: mp1_snap_idle_rcu
+ * Desc: RCU callback returning a replaced snapshot to the idle list
+ *
+ */
+static void mp1_snap_idle_rcu(struct rcu_head *head)
+{
+	llist_add(&container_of(head, struct mp1_snap, rcu)->idle,
+		  &mp1_snap_idle);
+}
+
+/* Func: mp1_snap_publish
+ * Desc: Replace the published snapshot by the one the last sweep built,
+ *       if it built one. The replaced one becomes idle after a grace
+ *       period
+ *
+ */
+static void mp1_snap_publish(void)
+{
+	struct mp1_snap *snap = mp1_sweep.snap, *old;
+	unsigned int i;
+
+	if (snap == NULL) {
+		return;
+	}
+
+	snap->seq = mp1_sweep.seq;
+	snap->total = 0;
+	for (i = 0; i < MP1_NR_SHARDS; i++) {
+		snap->total += snap->nr[i];
+	}
+
+	old = rcu_dereference_protected(mp1_snap, 1);
+	rcu_assign_pointer(mp1_snap, snap);
+	if (old) {
+		call_rcu(&old->rcu, mp1_snap_idle_rcu);
+	}
+}
+
+/* Func: mp1_snap_free
+ * Desc: Free the snapshot buffers
+ *
+ */
+static void mp1_snap_free(void)
+{
+	unsigned int i;
+
+	RCU_INIT_POINTER(mp1_snap, NULL);
+	/* Replaced snapshots still on their way to the idle list */
+	rcu_barrier();
+	for (i = 0; i < mp1_nr_snaps; i++) {
+		vfree(mp1_snaps[i]->items);
+		kfree(mp1_snaps[i]);
+		mp1_snaps[i] = NULL;
+	}
+	mp1_nr_snaps = 0;
+	init_llist_head(&mp1_snap_idle);
+}
+
+/* Func: mp1_snap_alloc
+ * Desc: Allocate the two snapshot buffers a sweep alternates between as
+ *       long as grace periods are shorter than the period
+ *
+ */
+static int mp1_snap_alloc(void)
 {
-#define PID_LEN 8
-	char pid_str[PID_LEN];
-	MP1_PROC_ENTRY *tmp;
 	int ret;
 
-	if (len > PID_LEN) {
-		len = PID_LEN;
+	if ((ret = mp1_snap_new()) != 0 || (ret = mp1_snap_new()) != 0) {
+		mp1_snap_free();
 	}
+	return ret;
+}
 
-	/* Copy the pid sent by the user process into kernel buffer */
-	if (copy_from_user(pid_str, buff, len)) {
-		return -EFAULT;
+/* Func: mp1_top_free
+ * Desc: Free the shard heaps and the published top list
+ *
+ */
+static void mp1_top_free(void)
+{
+	int i;
+
+	for (i = 0; i < MP1_NR_SHARDS; i++) {
+		kfree(mp1_shards[i].top);
+		mp1_shards[i].top = NULL;
+		mp1_shards[i].top_nr = 0;
 	}
+	kfree(rcu_dereference_protected(mp1_top, 1));
+	RCU_INIT_POINTER(mp1_top, NULL);
+}
 
-	/* Allocate a new list entry */
-	tmp = kmalloc(sizeof(*tmp), GFP_KERNEL);
+/* Func: mp1_top_alloc
+ * Desc: Allocate a heap of top_k items for every shard
+ *
+ */
+static int mp1_top_alloc(void)
+{
+	int i;
 
-	/* Store the pid */
-	sscanf(pid_str,"%u", &tmp->pid);
+	if (top_k > MP1_TOP_K_MAX) {
+		return -EINVAL;
+	}
 
-	/* Initialize time to 0 */
-	tmp->cpu_time = 0;
+	for (i = 0; i < MP1_NR_SHARDS; i++) {
+		mp1_shards[i].top = kcalloc(max(top_k, 1U),
+					    sizeof(struct mp1_top_item),
+					    GFP_KERNEL);
+		if (mp1_shards[i].top == NULL) {
+			mp1_top_free();
+			return -ENOMEM;
+		}
+	}
+	return 0;
+}
 
-	/* Initialize list structure in the entry */
-	INIT_LIST_HEAD(&tmp->list);
+/* Func: mp1_top_show
+ * Desc: Provide pid, utilization of the last interval and its 1s, 10s and
+ *       60s averages of the busiest processes of the last sweep
+ *
+ */
+static int mp1_top_show(struct seq_file *m, void *v)
+{
+	struct mp1_top_item *item;
+	struct mp1_top *top;
+	unsigned int i;
 
-	/* Enter critical region */
-	if (down_interruptible(&mp1_sem)) {
-		printk(KERN_INFO "mp1:Unable to enter critical region\n");
-		return 0;
+	rcu_read_lock();
+	top = rcu_dereference(mp1_top);
+	for (i = 0; top && i < top->nr; i++) {
+		item = &top->items[i];
+		seq_printf(m, "%u:%llu.%02llu %llu.%02llu %llu.%02llu %llu.%02llu\n",
+			   item->pid,
+			   MP1_FIXED_INT(item->util), MP1_FIXED_FRAC(item->util),
+			   MP1_FIXED_INT(item->avg[0]), MP1_FIXED_FRAC(item->avg[0]),
+			   MP1_FIXED_INT(item->avg[1]), MP1_FIXED_FRAC(item->avg[1]),
+			   MP1_FIXED_INT(item->avg[2]), MP1_FIXED_FRAC(item->avg[2]));
 	}
+	rcu_read_unlock();
+	return 0;
+}
 
-	/* For the first entry, start the timer */
-	if (list_empty(&mp1_proc_list.list)) {
-		printk(KERN_INFO "mp1:list is empty..starting timer\n");
-		/* Starting timer for 5 secs from now */
-		ret = mod_timer(&mp1_timer, jiffies + msecs_to_jiffies(5000));
-		/* Not able to start the timer? */
-		if (ret) {
-			printk(KERN_INFO "mp1:Error in mod_timer\n");
+/* Func: mp1_top_open
+ * Desc: Open /proc/mp1/top
+ *
+ */
+static int mp1_top_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, mp1_top_show, NULL);
+}
+
+static const struct file_operations mp1_top_fops = {
+	.owner = THIS_MODULE,
+	.open = mp1_top_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Func: mp1_sweep_slot
+ * Desc: Refresh the entry in one slot during a sweep, reaping it if its
+ *       process is gone. Caller must hold the lock of the slot's shard
+ *
+ */
+static void mp1_sweep_slot(struct mp1_shard *shard, unsigned int slot,
+			   struct mp1_ring_cursor *cur)
+{
+	struct mp1_top_item item;
+	MP1_PROC_ENTRY *tmp;
+	u64 prev_cpu_ns, prev_util;
+	int ret;
+
+	/* Idle entries backed off to a longer interval. Decided from the slot
+	   arrays alone, without touching the entry */
+	if (mp1_sweep.adaptive &&
+	    time_before(mp1_sweep.seq, mp1_slots.next_sample[slot])) {
+		this_cpu_inc(mp1_stats.skipped);
+		return;
+	}
+	/* Released slots wait for the grace period with no entry */
+	tmp = rcu_dereference_protected(mp1_slots.entry[slot],
+					lockdep_is_held(&shard->lock));
+	if (tmp == NULL) {
+		return;
+	}
+	/* Entries of exited processes already hold their final cpu time;
+	   log it to the history and reap them */
+	if (tmp->exited) {
+		mp1_group_account(tmp);
+		mp1_check_budget(tmp);
+		mp1_ring_append(tmp, cur);
+		mp1_remove_entry(tmp);
+		return;
+	}
+	prev_cpu_ns = mp1_slots.cpu_ns[slot];
+	prev_util = tmp->util;
+	/* check for return value and update link list accordingly.
+	   Only hit if the exit hook is unavailable */
+	ret = mp1_sample(tmp, mp1_sweep.mode);
+	if (ret == -1 && !tmp->exit_sampled) {
+		printk(KERN_INFO "mp1:deleting %u\n", mp1_slots.pid[slot]);
+		this_cpu_inc(mp1_stats.dead);
+		mp1_remove_entry(tmp);
+		return;
+	}
+	/* The threads of a group exited together; the last sample, this
+	   one or the exit hook's, is final */
+	if (ret != 0) {
+		printk(KERN_INFO "mp1:%u exited, cpu time %llu\n",
+		       mp1_slots.pid[slot], tmp->cpu_time);
+		tmp->prev_stamp = mp1_sweep.now;
+		mp1_group_account(tmp);
+		mp1_check_budget(tmp);
+		mp1_ring_append(tmp, cur);
+		mp1_remove_entry(tmp);
+		return;
+	}
+	this_cpu_inc(mp1_stats.sampled);
+	mp1_group_account(tmp);
+	mp1_check_budget(tmp);
+	mp1_update_rates(tmp, mp1_sweep.now);
+	mp1_ring_append(tmp, cur);
+
+	/* Rank the entry within its shard. Backed off entries did not use cpu
+	   time lately, so leaving them out does not change the list */
+	item.pid = mp1_slots.pid[slot];
+	item.util = tmp->util;
+	memcpy(item.avg, tmp->avg, sizeof(item.avg));
+	mp1_top_push(shard->top, &shard->top_nr, top_k, &item);
+
+	/* Report the entry to the delta feed if it used cpu time or just went
+	   idle. The averages of idle entries decay without being reported */
+	if (mp1_slots.cpu_ns[slot] != prev_cpu_ns || tmp->util != prev_util) {
+		tmp->changed_gen = atomic_long_read(&mp1_gen);
+	}
+
+	/* Entries with a pending budget are never backed off, so the alarm
+	   is at most one sweep late */
+	if (mp1_sweep.adaptive) {
+		mp1_adapt_interval(tmp, mp1_slots.cpu_ns[slot] != prev_cpu_ns ||
+				   (tmp->budget_ns && !tmp->budget_fired));
+	}
+}
+
+/* Func: mp1_shard_work_fn
+ * Desc: Update the cpu time of every process registered in one shard.
+ *       Runs as a work item on the CPU the sweep assigned to the shard.
+ *       The shard's slots are scanned in order, in batches of sweep_batch
+ *       entries; between batches the lock is dropped and the CPU yielded.
+ *       The slot index is the resume cursor, which registrations and
+ *       removals cannot invalidate
+ *
+ */
+static void mp1_shard_work_fn(struct work_struct *work)
+{
+	struct mp1_shard *shard = container_of(work, struct mp1_shard, work);
+	unsigned int batch = max(ACCESS_ONCE(sweep_batch), 1U);
+	unsigned int base = (shard - mp1_shards) * mp1_slots.per_shard;
+	struct mp1_ring_cursor cur = { &mp1_ring_stage[base], 0 };
+	unsigned int end = base + mp1_slots.per_shard;
+	struct mp1_snap *snap = mp1_sweep.snap;
+	struct mp1_snap_item *item = snap ? &snap->items[base] : NULL;
+	unsigned int slot, n = 0, visited = 0;
+	MP1_PROC_ENTRY *tmp;
+
+	spin_lock(&shard->lock);
+
+	shard->top_nr = 0;
+
+	/* Update the cpu time for each registered process */
+	for (slot = find_next_zero_bit(mp1_slots.free, end, base); slot < end;
+	     slot = find_next_zero_bit(mp1_slots.free, end, slot + 1)) {
+		mp1_sweep_slot(shard, slot, &cur);
+		visited++;
+		/* Add the entry to the snapshot unless it was reaped */
+		tmp = rcu_dereference_protected(mp1_slots.entry[slot], 1);
+		if (tmp && snap) {
+			mp1_snap_fill(item++, tmp);
+		}
+		if (++n == batch) {
+			spin_unlock(&shard->lock);
+			cond_resched();
+			spin_lock(&shard->lock);
+			n = 0;
 		}
 	}
 
-	/* Add the entry to the head */
-	list_add_tail(&(tmp->list), &(mp1_proc_list.list));
+	mp1_ring_flush(&cur);
 
-	/* Exit critical region */
-	up(&mp1_sem);
+	if (snap) {
+		snap->nr[shard - mp1_shards] = item - &snap->items[base];
+	}
 
-	return len;
+	spin_unlock(&shard->lock);
+
+	this_cpu_add(mp1_stats.visited, visited);
+	atomic_add(visited, &mp1_sweep.visited);
+
+	/* Last shard done completes the sweep */
+	if (atomic_dec_and_test(&mp1_sweep.pending)) {
+		complete(&mp1_sweep.done);
+	}
+}
+
+/* Func: mp1_sweep_shards
+ * Desc: Refresh all non empty shards in parallel, spreading their work
+ *       items over the online CPUs, and wait until all of them are done
+ *
+ */
+static void mp1_sweep_shards(void)
+{
+	int i, cpu;
+
+	/* One timestamp and accounting mode for the whole sweep */
+	mp1_sweep.now = ktime_to_ns(ktime_get());
+	mp1_sweep.mode = ACCESS_ONCE(acct_mode);
+	mp1_sweep.seq = mp1_sweep_seq + 1;
+	mp1_sweep.adaptive = ACCESS_ONCE(adaptive);
+
+	/* A buffer no reader is copying any more, NULL if the sweep skips
+	   the snapshot; it never waits for readers */
+	mp1_sweep.snap = mp1_snap_get();
+
+	/* Hold one extra count so the sweep cannot complete while work
+	   items are still being queued */
+	atomic_set(&mp1_sweep.pending, 1);
+	atomic_set(&mp1_sweep.visited, 0);
+	init_completion(&mp1_sweep.done);
+
+	get_online_cpus();
+	cpu = cpumask_first(cpu_online_mask);
+	for (i = 0; i < MP1_NR_SHARDS; i++) {
+		if (ACCESS_ONCE(mp1_shards[i].nr) == 0) {
+			/* Nothing of the shard makes the top list or the
+			   snapshot */
+			mp1_shards[i].top_nr = 0;
+			if (mp1_sweep.snap) {
+				mp1_sweep.snap->nr[i] = 0;
+			}
+			continue;
+		}
+		atomic_inc(&mp1_sweep.pending);
+		queue_work_on(cpu, mp1_wq, &mp1_shards[i].work);
+
+		cpu = cpumask_next(cpu, cpu_online_mask);
+		if (cpu >= nr_cpu_ids) {
+			cpu = cpumask_first(cpu_online_mask);
+		}
+	}
+	put_online_cpus();
+
+	if (!atomic_dec_and_test(&mp1_sweep.pending)) {
+		wait_for_completion(&mp1_sweep.done);
+	}
 }
 
 /* Func: mp1_kernel_thread_fn
- * Desc: Kernel thread to update the linked list of
- *       registered processes
+ * Desc: Kernel thread driving the sweeps that update the registered
+ *       processes
  *
  */
 int mp1_kernel_thread_fn(void *unused)
 {
-	MP1_PROC_ENTRY *tmp, *swap;
-	int ret;
-
 	/* Declare a waitqueue */
 	DECLARE_WAITQUEUE(wait,current);
+	ktime_t start;
+	u64 elapsed, expires;
 
 	/* Add wait queue to the head */
 	add_wait_queue(&mp1_waitqueue,&wait);
@@ -155,8 +3481,12 @@ int mp1_kernel_thread_fn(void *unused)
 		/* Set current state to interruptible */
 		set_current_state(TASK_INTERRUPTIBLE);
 
-		/* give up the control */
-		schedule();
+		/* give up the control, unless a kthread_stop() came during the
+		   last sweep: its wake up found the thread running, and with
+		   the timer cancelled nothing else would wake it */
+		if (!kthread_should_stop()) {
+			schedule();
+		}
 
 		/* coming back to running state, check if it needs to stop */
 		if (kthread_should_stop()) {
@@ -164,35 +3494,41 @@ int mp1_kernel_thread_fn(void *unused)
 			break;
 		}
 
-		printk(KERN_INFO "mp1:updating cpu time of processes\n");
+		/* How late the thread runs against the expiry that woke it */
+		start = ktime_get();
+		expires = ACCESS_ONCE(mp1_timer_expires);
+		if (expires && ktime_to_ns(start) > expires) {
+			mp1_hist_add(timer_late_ns, ktime_to_ns(start) - expires);
+		}
+
+		/* Refresh the shards in parallel */
+		mp1_sweep_shards();
+
+		mp1_ring_publish();
+		mp1_top_publish();
+		mp1_snap_publish();
+
+		elapsed = ktime_to_ns(ktime_sub(ktime_get(), start));
+		this_cpu_inc(mp1_stats.sweeps);
+		mp1_hist_add(sweep_ns, elapsed);
+		mp1_hist_add(sweep_entries, atomic_read(&mp1_sweep.visited));
+
+		/* Sweep done, wake up the pollers */
+		mp1_ring_hdr->sweep_ns = elapsed;
+		mp1_sweep_seq++;
+		mp1_ring_hdr->seq = mp1_sweep_seq;
+		wake_up_interruptible(&mp1_sweep_wq);
 
 		/* Enter critical region */
-		if (down_interruptible(&mp1_sem)) {
+		if (mp1_sem_down()) {
 			printk(KERN_INFO "mp1: Cannot enter critical region\n");
+			continue;
 		}
 
-		/* Traverse the list and update the cpu time for each registered
-		   process */
-		list_for_each_entry_safe(tmp, swap, &mp1_proc_list.list, list) {
-			/* check for return value and update link list accordingly */
-			if (get_cpu_use(tmp->pid, &tmp->cpu_time) == -1) {
-				printk(KERN_INFO "mp1:deleting %u\n",tmp->pid);
-				list_del(&tmp->list);
-				kfree(tmp);
-			}
-		}
-
-		if (list_empty(&mp1_proc_list.list)) {
-			/* If list is now empty, we need not start the timer */
-			printk(KERN_INFO "mp1:All entries removed. Not starting timer\n");
-		} else {
-			/* Start the timer here */
-			ret = mod_timer(&mp1_timer, jiffies + msecs_to_jiffies(5000));
-
-			/* Not able to start the timer? */
-			if (ret) {
-				printk(KERN_INFO "mp1:Error in mod_timer\n");
-			}
+		if (atomic_read(&mp1_nr_entries) == 0) {
+			/* If list is now empty, we need not keep the timer */
+			printk(KERN_INFO "mp1:All entries removed. Stopping timer\n");
+			hrtimer_cancel(&mp1_timer);
 		}
 
 		/* Exit critical region */
@@ -214,7 +3550,51 @@ int mp1_kernel_thread_fn(void *unused)
  */
 static int __init mp1_init_module(void)
 {
-	int ret = 0;
+	int ret = 0, i;
+
+	/* Initialize the shards */
+	for (i = 0; i < MP1_NR_SHARDS; i++) {
+		spin_lock_init(&mp1_shards[i].lock);
+		mp1_shards[i].nr = 0;
+		INIT_WORK(&mp1_shards[i].work, mp1_shard_work_fn);
+	}
+
+	/* Initialize semaphore */
+	sema_init(&mp1_sem,1);
+
+	/* Decay factors for the initial period */
+	mp1_update_decay();
+
+	/* Setup the timer */
+	hrtimer_init(&mp1_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	mp1_timer.function = mp1_timer_callback;
+
+	/* Allocate the PID hash table and the registry slots */
+	if ((ret = mp1_registry_alloc()) != 0) {
+		return ret;
+	}
+
+	/* Allocate the shard heaps of the top list */
+	if ((ret = mp1_top_alloc()) != 0) {
+		goto clear_alloc;
+	}
+
+	/* Allocate the snapshot buffers of the readers */
+	if ((ret = mp1_snap_alloc()) != 0) {
+		goto clear_alloc;
+	}
+
+	/* Allocate the history ring to share with user */
+	if ((ret = mp1_ring_alloc()) != 0) {
+		goto clear_alloc;
+	}
+
+	/* Per CPU workqueue for the shard sweeps */
+	mp1_wq = alloc_workqueue("mp1_sweep", 0, 0);
+	if (mp1_wq == NULL) {
+		ret = -ENOMEM;
+		goto clear_alloc;
+	}
 
 	/* Create a proc directory entry mp1 */
 	proc_dir = proc_mkdir("mp1", NULL);
@@ -223,46 +3603,127 @@ static int __init mp1_init_module(void)
 	if (proc_dir == NULL) {
 		printk(KERN_INFO "mp1: Couldn't create proc dir\n");
 		ret = -ENOMEM;
-	} else {
-		/* Create an entry status under proc dir mp1 */
-		proc_entry = create_proc_entry( "status", 0666, proc_dir);
+		goto clear_alloc;
+	}
 
-		/*Check if entry was created */
-		if (proc_entry == NULL) {
-			printk(KERN_INFO "mp1: Couldn't create proc entry\n");
-			ret = -ENOMEM;
-		} else {
+	/* Create an entry status under proc dir mp1 */
+	proc_entry = proc_create("status", 0666, proc_dir, &mp1_proc_fops);
 
-			/* proc_entry->owner = THIS_MODULE; */
-			proc_entry->read_proc = mp1_read_proc;
-			proc_entry->write_proc = mp1_write_proc;
+	/*Check if entry was created */
+	if (proc_entry == NULL) {
+		printk(KERN_INFO "mp1: Couldn't create proc entry\n");
+		ret = -ENOMEM;
+		goto clear_alloc;
+	}
+
+	/* Create the sampling period knob */
+	proc_period = proc_create("period", 0644, proc_dir, &mp1_period_fops);
+	if (proc_period == NULL) {
+		printk(KERN_INFO "mp1: Couldn't create period entry\n");
+		ret = -ENOMEM;
+		goto clear_alloc;
+	}
 
-			printk(KERN_INFO "mp1:MP1 module loaded\n");
+	/* Create the instrumentation entry */
+	proc_stats = proc_create("stats", 0644, proc_dir, &mp1_stats_fops);
+	if (proc_stats == NULL) {
+		printk(KERN_INFO "mp1: Couldn't create stats entry\n");
+		ret = -ENOMEM;
+		goto clear_alloc;
+	}
 
-			/* Initialize a linked list for mp1 proc details */
-			INIT_LIST_HEAD(&mp1_proc_list.list);
+	/* Create the group totals entry */
+	proc_groups = proc_create("groups", 0444, proc_dir, &mp1_groups_fops);
+	if (proc_groups == NULL) {
+		printk(KERN_INFO "mp1: Couldn't create groups entry\n");
+		ret = -ENOMEM;
+		goto clear_alloc;
+	}
 
-			/* Initialize semaphore */
-			sema_init(&mp1_sem,1);
+	/* Create the change feed entry */
+	proc_delta = proc_create("delta", 0444, proc_dir, &mp1_delta_fops);
+	if (proc_delta == NULL) {
+		printk(KERN_INFO "mp1: Couldn't create delta entry\n");
+		ret = -ENOMEM;
+		goto clear_alloc;
+	}
 
-			/* Create a kernel thread */
-			mp1_kernel_thread = kthread_run(mp1_kernel_thread_fn,
-							NULL,
-							"mp1kt");
+	/* Create the top list entry */
+	proc_top = proc_create("top", 0444, proc_dir, &mp1_top_fops);
+	if (proc_top == NULL) {
+		printk(KERN_INFO "mp1: Couldn't create top entry\n");
+		ret = -ENOMEM;
+		goto clear_alloc;
+	}
 
-			/* If thread creation failed for some reason, cleanup */
-			if (mp1_kernel_thread == NULL) {
-				printk(KERN_INFO "mp1:thread not created\n");
-				remove_proc_entry("status", proc_dir);
-				remove_proc_entry("mp1", NULL);
-				ret = -ENOMEM;
-			} else {
-				/* Setup the timer */
-				setup_timer(&mp1_timer, mp1_timer_callback, 0);
-			}
-		}
+	/* Create the sweep count entry */
+	proc_seqno = proc_create("seq", 0444, proc_dir, &mp1_seqno_fops);
+	if (proc_seqno == NULL) {
+		printk(KERN_INFO "mp1: Couldn't create seq entry\n");
+		ret = -ENOMEM;
+		goto clear_alloc;
 	}
 
+	/* Create a kernel thread */
+	mp1_kernel_thread = kthread_run(mp1_kernel_thread_fn, NULL, "mp1kt");
+
+	/* If thread creation failed for some reason, cleanup */
+	if (IS_ERR(mp1_kernel_thread)) {
+		printk(KERN_INFO "mp1:thread not created\n");
+		ret = PTR_ERR(mp1_kernel_thread);
+		mp1_kernel_thread = NULL;
+		goto clear_alloc;
+	}
+
+	/* Create the /dev/mp1 character device */
+	if ((ret = mp1_create_char_dev()) != 0) {
+		goto clear_alloc;
+	}
+
+	/* Deregister processes the moment they exit. Without the hook the
+	   sweep still drops dead processes */
+	if (profile_event_register(PROFILE_TASK_EXIT, &mp1_exit_nb)) {
+		printk(KERN_INFO "mp1:exit hook not available\n");
+	}
+
+	printk(KERN_INFO "mp1:MP1 module loaded\n");
+
+	return ret;
+ clear_alloc:
+	if (mp1_kernel_thread) {
+		kthread_stop(mp1_kernel_thread);
+	}
+	if (proc_seqno) {
+		remove_proc_entry("seq", proc_dir);
+	}
+	if (proc_delta) {
+		remove_proc_entry("delta", proc_dir);
+	}
+	if (proc_top) {
+		remove_proc_entry("top", proc_dir);
+	}
+	if (proc_groups) {
+		remove_proc_entry("groups", proc_dir);
+	}
+	if (proc_stats) {
+		remove_proc_entry("stats", proc_dir);
+	}
+	if (proc_period) {
+		remove_proc_entry("period", proc_dir);
+	}
+	if (proc_entry) {
+		remove_proc_entry("status", proc_dir);
+	}
+	if (proc_dir) {
+		remove_proc_entry("mp1", NULL);
+	}
+	if (mp1_wq) {
+		destroy_workqueue(mp1_wq);
+	}
+	mp1_ring_free();
+	mp1_top_free();
+	mp1_snap_free();
+	mp1_registry_free();
 	return ret;
 }
 
@@ -272,31 +3733,66 @@ static int __init mp1_init_module(void)
  */
 static void __exit mp1_exit_module(void)
 {
-	MP1_PROC_ENTRY *tmp,*swap;
+	struct mp1_group *group, *swap;
+	MP1_PROC_ENTRY *tmp;
+	unsigned int i;
 
-	/* Delete the timer */
-	del_timer_sync(&mp1_timer);
+	/* No more exit notifications */
+	profile_event_unregister(PROFILE_TASK_EXIT, &mp1_exit_nb);
 
-	/* Remove the status entry first */
+	/* Remove the interfaces before the timer, a registration could
+	   start it again. Remove the other entries first */
 	remove_proc_entry("status", proc_dir);
+	remove_proc_entry("period", proc_dir);
+	remove_proc_entry("stats", proc_dir);
+	remove_proc_entry("groups", proc_dir);
+	remove_proc_entry("top", proc_dir);
+	remove_proc_entry("delta", proc_dir);
+	remove_proc_entry("seq", proc_dir);
 
 	/* Remove the mp1 proc dir now */
 	remove_proc_entry("mp1", NULL);
 
-	printk(KERN_INFO "mp1:MP1 module unloaded\n");
+	/* Remove /dev/mp1 */
+	mp1_delete_char_dev();
 
-	/* Delete each list entry and free the allocated structure */
-	list_for_each_entry_safe(tmp, swap, &mp1_proc_list.list, list) {
-		printk(KERN_INFO "mp1:freeing %u\n",tmp->pid);
-		list_del(&tmp->list);
-		kfree(tmp);
-	}
+	/* Delete the timer. A period change restarts it only while active,
+	   and does so under mp1_sem */
+	down(&mp1_sem);
+	hrtimer_cancel(&mp1_timer);
+	up(&mp1_sem);
+
+	printk(KERN_INFO "mp1:MP1 module unloaded\n");
 
 	/* Before stopping the thread, put it into running state */
 	wake_up_interruptible(&mp1_waitqueue);
 
-	/* now stop the thread */
+	/* now stop the thread, so no sweep runs while the list is freed */
 	kthread_stop(mp1_kernel_thread);
+	destroy_workqueue(mp1_wq);
+
+	/* Delete each entry and free the allocated structure */
+	for (i = 0; i < mp1_slots.nr; i++) {
+		tmp = rcu_dereference_protected(mp1_slots.entry[i], 1);
+		if (tmp) {
+			printk(KERN_INFO "mp1:freeing %u\n", mp1_slots.pid[i]);
+			mp1_remove_entry(tmp);
+		}
+	}
+
+	/* Delete the groups, no reader or entry is left to use them */
+	list_for_each_entry_safe(group, swap, &mp1_groups, list) {
+		list_del_rcu(&group->list);
+		kfree_rcu(group, rcu);
+	}
+
+	/* Wait for the pending RCU frees before the slots go away */
+	rcu_barrier();
+
+	mp1_ring_free();
+	mp1_top_free();
+	mp1_snap_free();
+	mp1_registry_free();
 }
 
 module_init(mp1_init_module);
@@ -1,83 +1,347 @@
 /*
  * mp1_user_app.c: User application for mp1
  *
+ * Calibrated CPU load generator. Runs N threads, each busy for a given
+ * percentage of every period as measured by CLOCK_THREAD_CPUTIME_ID, and
+ * registers them with the module through /dev/mp1. Once the load is over
+ * it waits for the module to sample the idle threads and compares, per
+ * thread, the cpu time it aimed for, the cpu time the thread clock
+ * measured and the cpu time mp1 reported.
+ *
+ * The thread clocks count user plus system time, which mp1 reports in
+ * acct_mode=1 (per thread) and acct_mode=2 (-g, per process). The module
+ * must be in the matching mode.
+ *
+ * Usage: mp1_user_app [-t threads] [-c percent] [-p period_ms] [-d seconds] [-g]
+ *
  */
 
 #include<stdio.h>
 #include<string.h>
 #include<stdlib.h>
+#include<unistd.h>
+#include<fcntl.h>
+#include<errno.h>
+#include<poll.h>
+#include<pthread.h>
+#include<time.h>
+#include<sys/ioctl.h>
+#include<sys/syscall.h>
+
+#include "mp1_dev.h"
+
+/* Upper bound of the thread count */
+#define MAX_THREADS 4096
+
+/* Defaults of the command line options */
+#define DEFAULT_THREADS 4
+#define DEFAULT_PERCENT 50
+#define DEFAULT_PERIOD_MS 100
+#define DEFAULT_SECONDS 10
+
+/* Accounting mode of the module, see acct_mode in mp1_kernel_mod.c */
+#define MP1_ACCT_MODE_PATH "/sys/module/mp1_kernel_mod/parameters/acct_mode"
+#define MP1_ACCT_TASK  1
+#define MP1_ACCT_GROUP 2
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+/* One load thread */
+struct worker {
+	pthread_t thread;
+	pid_t tid;
+	/* cpu time the duty cycle aimed for */
+	unsigned long long target_ns;
+	/* Clock of the thread, valid while it lives */
+	clockid_t clock;
+};
+
+/* Open /dev/mp1 */
+static int mp1_fd = -1;
+
+/* Parameters of the load, the same for every thread */
+static unsigned long long period_ns, busy_ns, end_ns;
+
+/* Started threads wait until all are registered, finished ones until the
+   results are collected */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int ready, started, done, release;
+
+/*
+ * Func: clock_ns
+ * Desc: Read a clock in ns
+ *
+ */
+static unsigned long long clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (unsigned long long)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/*
+ * Func: sleep_until
+ * Desc: Sleep until the given CLOCK_MONOTONIC time in ns
+ *
+ */
+static void sleep_until(unsigned long long ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / NSEC_PER_SEC;
+	ts.tv_nsec = ns % NSEC_PER_SEC;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/*
+ * Func: wait_for
+ * Desc: Wait until *flag is set
+ *
+ */
+static void wait_for(int *flag)
+{
+	pthread_mutex_lock(&lock);
+	while (!*flag) {
+		pthread_cond_wait(&cond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Func: count
+ * Desc: Increment *counter and wake up the waiters
+ *
+ */
+static void count(int *counter)
+{
+	pthread_mutex_lock(&lock);
+	(*counter)++;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Func: acct_mode
+ * Desc: Accounting mode of the loaded module, -1 if unknown
+ *
+ */
+static int acct_mode(void)
+{
+	FILE *f = fopen(MP1_ACCT_MODE_PATH, "r");
+	int mode = -1;
+
+	if (f == NULL) {
+		return -1;
+	}
+	if (fscanf(f, "%d", &mode) != 1) {
+		mode = -1;
+	}
+	fclose(f);
+	return mode;
+}
 
 /*
  * Func: register_process
  * Desc: Registering the process with kernel module
  *
  */
-void register_process(int pid) {
-        char command[100];
-	/* Write to /proc/mp1/status */
-        sprintf(command, "echo %d >/proc/mp1/status", pid);
-        system(command);
+int register_process(int pid) {
+	__u32 upid = pid;
+
+	/* One ioctl, no fork+exec of a shell */
+	if (ioctl(mp1_fd, MP1_IOC_REGISTER, &upid) < 0) {
+		fprintf(stderr, "MP1_IOC_REGISTER %d: %s\n", pid, strerror(errno));
+		return -1;
+	}
+	return 0;
 }
 
 /*
- * Func: read_proc
- * Desc: Reading back from the kernel module
+ * Func: unregister_process
+ * Desc: Remove the process from the kernel module
+ *
+ */
+void unregister_process(int pid) {
+	__u32 upid = pid;
+
+	ioctl(mp1_fd, MP1_IOC_UNREGISTER, &upid);
+}
+
+/*
+ * Func: run_load
+ * Desc: Body of a load thread. In every period it runs until its thread
+ *       clock reaches the cpu time due so far, then sleeps out the rest of
+ *       the period. Time lost to preemption is made up in the following
+ *       periods, as far as they have room for it
  *
  */
-void read_proc()
+static void *run_load(void *arg)
 {
-	/* read from /proc/mp1/status */
-	char command[] = "cat /proc/mp1/status";
-	printf("Printing return value of read from /proc/mp1/status\n");
-	printf("PID:CPU Time\n");
-	system(command);
+	struct worker *w = arg;
+	unsigned long long cpu0, due, next;
+	volatile unsigned long spin = 0;
+
+	w->tid = syscall(SYS_gettid);
+	pthread_getcpuclockid(pthread_self(), &w->clock);
+	count(&ready);
+	wait_for(&started);
+
+	cpu0 = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	due = 0;
+	for (next = clock_ns(CLOCK_MONOTONIC) + period_ns; next <= end_ns;
+	     next += period_ns) {
+		due += busy_ns;
+		while (clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu0 < due &&
+		       clock_ns(CLOCK_MONOTONIC) < next) {
+			spin++;
+		}
+		sleep_until(next);
+	}
+	w->target_ns = due;
+
+	/* Stay alive, and registered, until the results are in */
+	count(&done);
+	wait_for(&release);
+	return NULL;
 }
 
 /*
- * Func: calculate_factorial
- * Desc: Calcuate factorial of a given number n
+ * Func: wait_sweeps
+ * Desc: Wait for n sweeps of the module to complete
  *
  */
-int calculate_factorial(int n) 
+static int wait_sweeps(int n)
 {
-	int prod=1, i=1; 
-	if (n<0) 
-		return -1; 
-	if (n==0)
-		return 1; 
-	for (i=2; i<=n; i++)
-		prod=prod*i; 
-	return prod; 
+	struct pollfd pfd = { .fd = mp1_fd, .events = POLLIN };
+	__u64 seq;
+
+	/* Count from the next completed sweep */
+	if (ioctl(mp1_fd, MP1_IOC_SEQ, &seq) < 0) {
+		perror("MP1_IOC_SEQ");
+		return -1;
+	}
+	while (n-- > 0) {
+		if (poll(&pfd, 1, -1) < 0) {
+			perror("poll");
+			return -1;
+		}
+		ioctl(mp1_fd, MP1_IOC_SEQ, &seq);
+	}
+	return 0;
 }
 
 /*
- * Func: find_factorial_factorial_times
- * Desc: Find factorial of a number for factorial times
+ * Func: read_proc
+ * Desc: Reading back from the kernel module: the cpu time mp1 reports for
+ *       pid, or -1 if it is not registered
  *
  */
-void find_factorial_factorial_times(int n, int fact)
+long long read_proc(struct mp1_record *recs, size_t nr, int pid)
 {
-	int i=0; 
+	size_t i;
 
-	for (i=0; i<=fact; i++) {
-		calculate_factorial(n); 
+	for (i = 0; i < nr; i++) {
+		if (recs[i].pid == (__u32)pid) {
+			return recs[i].cpu_time;
+		}
 	}
-	printf("Factorial of %d is calculated %d times !\n", n, calculate_factorial(n)); 
+	return -1;
 }
 
 /*
- * Func: find_factorials
- * Desc: Find factorials of numbers from 1 to n
+ * Func: report
+ * Desc: Print expected, measured and mp1 reported cpu time per thread, or
+ *       for the whole process in group mode, and their totals
  *
  */
-void find_factorials(int n) 
+static void report(struct worker *w, int n, int group)
 {
+	struct mp1_record *recs;
+	unsigned long long thread, measured, total_target = 0;
+	unsigned long long total_thread = 0, total_mp1 = 0;
+	long long mp1;
+	ssize_t len;
+	size_t nr = n + 1;
 	int i;
 
-	for (i=0; i<=n; i++) {
-		printf("\nFactorial of %d is %d\n", i, calculate_factorial(i)); 
-		find_factorial_factorial_times(i, calculate_factorial(i)); 
+	/* One pread returns a packed snapshot of all records, ours among
+	   those of other users of the module */
+	for (;;) {
+		recs = malloc(nr * sizeof(*recs));
+		if (recs == NULL) {
+			perror("malloc");
+			return;
+		}
+		len = pread(mp1_fd, recs, nr * sizeof(*recs), 0);
+		if (len < 0) {
+			perror("read " MP1_DEV_PATH);
+			free(recs);
+			return;
+		}
+		if ((size_t)len < nr * sizeof(*recs)) {
+			break;
+		}
+		free(recs);
+		nr *= 2;
+	}
+	nr = len / sizeof(*recs);
+
+	printf("%-8s %14s %14s %14s %8s\n", "TID", "target_ns", "thread_ns",
+	       "mp1_ns", "err%");
+	for (i = 0; i < n; i++) {
+		measured = clock_ns(w[i].clock);
+		total_target += w[i].target_ns;
+		total_thread += measured;
+		if (group) {
+			continue;
+		}
+		mp1 = read_proc(recs, nr, w[i].tid);
+		if (mp1 < 0) {
+			printf("%-8d %14llu %14llu %14s %8s\n", w[i].tid,
+			       w[i].target_ns, measured, "-", "-");
+			continue;
+		}
+		total_mp1 += mp1;
+		printf("%-8d %14llu %14llu %14lld %8.2f\n", w[i].tid,
+		       w[i].target_ns, measured, mp1,
+		       measured ? (mp1 - (double)measured) * 100 / measured : 0);
+	}
+
+	/* In group mode mp1 accounts the whole process, main thread too */
+	thread = total_thread;
+	if (group) {
+		thread = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+		mp1 = read_proc(recs, nr, getpid());
+		total_mp1 = mp1 < 0 ? 0 : mp1;
 	}
+	printf("%-8s %14llu %14llu %14llu %8.2f\n", "total", total_target, thread,
+	       total_mp1,
+	       thread ? ((double)total_mp1 - thread) * 100 / thread : 0);
+
+	free(recs);
+}
+
+/*
+ * Func: usage
+ * Desc: Print the command line options
+ *
+ */
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"Usage: %s [-t threads] [-c percent] [-p period_ms] [-d seconds] [-g]\n"
+		"  -t  load threads, 1-%d (default %d)\n"
+		"  -c  cpu percent each thread is busy, 1-100 (default %d)\n"
+		"  -p  duty cycle period in ms (default %d)\n"
+		"  -d  duration of the load in s (default %d)\n"
+		"  -g  register the process, for acct_mode=2, instead of the threads\n"
+		"      (which need acct_mode=1)\n",
+		prog, MAX_THREADS, DEFAULT_THREADS, DEFAULT_PERCENT,
+		DEFAULT_PERIOD_MS, DEFAULT_SECONDS);
 }
 
 /*
@@ -85,26 +349,118 @@ void find_factorials(int n)
  * Desc: main body of the user space application
  *
  */
-void main(int argc, char **argv)
+int main(int argc, char **argv)
 {
-	int pid;
-	int n = 12;
+	int threads = DEFAULT_THREADS, percent = DEFAULT_PERCENT;
+	int period_ms = DEFAULT_PERIOD_MS, seconds = DEFAULT_SECONDS;
+	int group = 0, opt, i, n, mode;
+	struct worker *w;
+
+	while ((opt = getopt(argc, argv, "t:c:p:d:g")) != -1) {
+		switch (opt) {
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'c':
+			percent = atoi(optarg);
+			break;
+		case 'p':
+			period_ms = atoi(optarg);
+			break;
+		case 'd':
+			seconds = atoi(optarg);
+			break;
+		case 'g':
+			group = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (threads < 1 || threads > MAX_THREADS || percent < 1 ||
+	    percent > 100 || period_ms < 1 || seconds < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	/* Otherwise mp1 and the thread clocks do not count the same time */
+	mode = acct_mode();
+	if (mode != (group ? MP1_ACCT_GROUP : MP1_ACCT_TASK)) {
+		fprintf(stderr, "acct_mode is %d, %s needs acct_mode=%d\n", mode,
+			group ? "-g" : "per thread accounting",
+			group ? MP1_ACCT_GROUP : MP1_ACCT_TASK);
+		return 1;
+	}
+
+	if ((mp1_fd = open(MP1_DEV_PATH, O_RDONLY)) < 0) {
+		perror("open " MP1_DEV_PATH);
+		return 1;
+	}
+
+	w = calloc(threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc");
+		return 1;
+	}
+
+	period_ns = period_ms * NSEC_PER_MSEC;
+	busy_ns = period_ns * percent / 100;
+
+	for (n = 0; n < threads; n++) {
+		if (pthread_create(&w[n].thread, NULL, run_load, &w[n]) != 0) {
+			perror("pthread_create");
+			break;
+		}
+	}
+
+	/* Register everything before the load starts */
+	pthread_mutex_lock(&lock);
+	while (ready < n) {
+		pthread_cond_wait(&cond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
 
-	/* Obtain the number to calculate factorial upto */
-	if (argc==2) {
-		n = atoi(argv[1]);
+	printf("PID of this process is %d, %d threads at %d%% of %d ms for %d s\n",
+	       getpid(), n, percent, period_ms, seconds);
+	if (group) {
+		register_process(getpid());
+	} else {
+		for (i = 0; i < n; i++) {
+			register_process(w[i].tid);
+		}
 	}
 
-	/* Get pid of the process */
-	pid=getpid(); 
-	printf("PID of this process is %d", pid); 
+	end_ns = clock_ns(CLOCK_MONOTONIC) + seconds * NSEC_PER_SEC;
+	count(&started);
 
-	/* Register the process with our module */
-	register_process(pid); 
+	/* The load is over once every thread is done */
+	pthread_mutex_lock(&lock);
+	while (done < n) {
+		pthread_cond_wait(&cond, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	/* A sweep in progress may predate the end of the load, the one after
+	   it samples the final cpu times */
+	if (wait_sweeps(2) == 0) {
+		report(w, n, group);
+	}
 
-	/* Calculate factorial */
-	find_factorials(n); 
+	if (group) {
+		unregister_process(getpid());
+	} else {
+		for (i = 0; i < n; i++) {
+			unregister_process(w[i].tid);
+		}
+	}
+
+	count(&release);
+	for (i = 0; i < n; i++) {
+		pthread_join(w[i].thread, NULL);
+	}
 
-	/* Read the entry in /proc/mp1/status */
-	read_proc();
+	free(w);
+	close(mp1_fd);
+	return 0;
 }